@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Camera.h"
+#include "ImageOutput.h"
+#include "Renderer.h"
+#include "Scene.h"
+#include "SceneCache.h"
+#include "TileScheduler.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+// Renders a scene repeatedly without writing any files and reports ray throughput and where the
+// time goes. Ray generation, intersection and shading are timed inside the workers and summed over
+// threads; tone mapping (also threaded) and image encoding (into memory) are wall time.
+int main(int argc, char** argv)
+{
+	RenderSettings settings;
+	int width = 1280, height = 720, iterations = 5;
+	std::string scene_name = "default";
+	const char* envmap_path = nullptr;
+	std::string environment_cache;
+	ImageFormat format = ImageFormat::Jpeg;
+	ToneMapSettings tone;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--width") && i + 1 < argc)
+			width = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--height") && i + 1 < argc)
+			height = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--scene") && i + 1 < argc)
+			scene_name = argv[++i];
+		else if (!strcmp(argv[i], "--envmap") && i + 1 < argc)
+			envmap_path = argv[++i];
+		else if (!strcmp(argv[i], "--format") && i + 1 < argc && parse_image_format(argv[i + 1], format))
+			++i;
+		else if (!strcmp(argv[i], "--tonemap") && i + 1 < argc && (!strcmp(argv[i + 1], "max") || !strcmp(argv[i + 1], "reinhard") || !strcmp(argv[i + 1], "aces"))) {
+			const char* name = argv[++i];
+			tone.op = !strcmp(name, "reinhard") ? ToneOperator::Reinhard : (!strcmp(name, "aces") ? ToneOperator::Aces : ToneOperator::Max);
+		}
+		else if (!strcmp(argv[i], "--gamma") && i + 1 < argc) {
+			const char* curve = argv[++i];
+			tone.transfer = !strcmp(curve, "srgb") ? TransferCurve::Srgb : TransferCurve::Gamma;
+			if (tone.transfer == TransferCurve::Gamma)
+				tone.gamma = std::stof(curve);
+		}
+		else if (!strcmp(argv[i], "--env-cache") && i + 1 < argc)
+			environment_cache = argv[++i];
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+			iterations = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			settings.threads = (unsigned)std::stoul(argv[++i]);
+		else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc)
+			settings.tile_size = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--no-packets"))
+			settings.packets = false;
+		else if (!strcmp(argv[i], "--min-weight") && i + 1 < argc)
+			settings.min_weight = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--roulette") && i + 1 < argc)
+			settings.roulette_weight = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--samples") && i + 1 < argc)
+			settings.samples = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--aa-threshold") && i + 1 < argc)
+			settings.adaptive_threshold = std::stof(argv[++i]);
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--width N] [--height N] [--scene default|spheres:N|FILE] [--envmap PATH] [--env-cache DIR] [--format jpg|png|hdr|pfm|raw] [--tonemap max|reinhard|aces] [--gamma G|srgb] [--iterations N]"
+				<< " [--threads N] [--tile-size N] [--no-packets] [--min-weight W] [--roulette W] [--samples N] [--aa-threshold T]" << std::endl;
+			return -1;
+		}
+	}
+	if (width <= 0 || height <= 0 || iterations <= 0) {
+		std::cerr << "Error: resolution and iteration count must be positive!" << std::endl;
+		return -1;
+	}
+	if (!valid_sample_count(settings.samples)) {
+		std::cerr << "Error: the sample count must be a perfect square (1, 4, 9, 16, ...)!" << std::endl;
+		return -1;
+	}
+	if (tone.transfer == TransferCurve::Gamma && !(tone.gamma > 0.0f)) {
+		std::cerr << "Error: the gamma must be positive!" << std::endl;
+		return -1;
+	}
+
+	Scene scene;
+	Clock::time_point load_start = Clock::now();
+	if (scene_name == "default") {
+		add_default_scene(scene);
+	}
+	else if (scene_name.compare(0, 8, "spheres:") == 0 && scene_name.size() > 8) {
+		add_random_spheres(scene, (uint32_t)std::stoul(scene_name.substr(8)));
+	}
+	else {
+		std::string error;
+		if (!load_scene(scene_name.c_str(), scene, error)) {
+			std::cerr << "Error: " << error << std::endl;
+			return -1;
+		}
+	}
+	double load_time = seconds_since(load_start);
+	Clock::time_point environment_start = Clock::now();
+	if (!scene.environment.load(envmap_path ? envmap_path : scene.environment_path.c_str(), environment_cache)) {
+		std::cerr << "Error: can not load the environment map!" << std::endl;
+		return -1;
+	}
+	double environment_time = seconds_since(environment_start);
+
+	Clock::time_point build_start = Clock::now();
+	if (!scene.hasAccelerationStructure())
+		scene.buildAccelerationStructure();
+	double build_time = seconds_since(build_start);
+
+	const View& view = scene.view;
+	Camera camera(view.position, view.look_at, view.up, view.fov, width, height);
+	unsigned threads = TileScheduler(width, height, settings.tile_size, settings.threads).threadCount();
+	printf("scene %s: %zu spheres, %zu triangles, loaded in %.2f ms, BVH built in %.2f ms\n", scene_name.c_str(), scene.spheres.size(), scene.triangles.size(),
+		load_time * 1e3, build_time * 1e3);
+	printf("environment map %dx%d, loaded in %.2f ms%s\n", scene.environment.imageWidth(), scene.environment.imageHeight(),
+		environment_time * 1e3, scene.environment.fromCache() ? " from the cache" : "");
+	printf("%dx%d, %u threads, tile size %d, packets %s, %d iterations\n\n", width, height, threads, settings.tile_size, settings.packets ? "on" : "off", iterations);
+
+	tone.threads = settings.threads;
+	const ToneMapper mapper(tone);
+	std::vector<vec3> framebuffer;
+	std::vector<unsigned char> pixmap;
+	std::vector<unsigned char> encoded_image;
+	RenderStats total;
+	double render_time = 0.0, tonemap_time = 0.0, encode_time = 0.0, frame_time = 0.0;
+	double best_frame = 0.0;
+
+	printf("frame   render ms   frame ms   Mrays/s\n");
+	for (int it = 0; it < iterations; ++it) {
+		Clock::time_point start = Clock::now();
+		RenderStats stats = render(scene, camera, settings, framebuffer);
+		Clock::time_point rendered = Clock::now();
+		// the float formats take the framebuffer as it is
+		if (!is_float_format(format))
+			mapper(framebuffer, pixmap);
+		Clock::time_point mapped = Clock::now();
+		encoded_image.clear();
+		auto sink = [](void* context, void* data, int size) {
+			std::vector<unsigned char>& out = *(std::vector<unsigned char>*)context;
+			out.insert(out.end(), (unsigned char*)data, (unsigned char*)data + size);
+		};
+		if (is_float_format(format))
+			encode_radiance(format, width, height, framebuffer.data(), sink, &encoded_image);
+		else
+			encode_pixmap(format, width, height, pixmap.data(), sink, &encoded_image, settings.threads);
+		Clock::time_point encoded = Clock::now();
+
+		double render_s = std::chrono::duration<double>(rendered - start).count();
+		double frame_s = std::chrono::duration<double>(encoded - start).count();
+		render_time += render_s;
+		tonemap_time += std::chrono::duration<double>(mapped - rendered).count();
+		encode_time += std::chrono::duration<double>(encoded - mapped).count();
+		frame_time += frame_s;
+		best_frame = it == 0 ? frame_s : std::min(best_frame, frame_s);
+		total += stats;
+		printf("%5d %11.2f %10.2f %9.2f\n", it, render_s * 1e3, frame_s * 1e3, stats.rays() / render_s * 1e-6);
+	}
+
+	double n = iterations;
+	double traced = total.generate_time + total.intersect_time + total.shade_time;
+	printf("\nper frame: %.2f samples per pixel, %.0f primary, %.0f secondary, %.0f shadow rays (%.0f culled, %.0f terminated)\n",
+		total.primary_rays / n / ((double)width * height), total.primary_rays / n, total.secondary_rays / n, total.shadow_rays / n, total.culled_rays / n, total.terminated_rays / n);
+	printf("throughput: %.2f Mrays/s over render time, %.2f Mrays/s per thread\n",
+		total.rays() / render_time * 1e-6, traced > 0.0 ? total.rays() / traced * 1e-6 : 0.0);
+	printf("frame time: %.2f ms mean, %.2f ms best, %zu byte image\n\n", frame_time / n * 1e3, best_frame * 1e3, encoded_image.size());
+
+	printf("stage              ms/frame   share\n");
+	auto stage = [&](const char* name, double seconds, double whole) {
+		printf("%-16s %10.2f %6.1f%%\n", name, seconds / n * 1e3, whole > 0.0 ? 100.0 * seconds / whole : 0.0);
+	};
+	printf("(thread time, summed over %u threads)\n", threads);
+	stage("ray generation", total.generate_time, traced);
+	stage("intersection", total.intersect_time, traced);
+	stage("shading", total.shade_time, traced);
+	printf("(wall time)\n");
+	stage("render", render_time, frame_time);
+	stage("tone mapping", tonemap_time, frame_time);
+	stage("encoding", encode_time, frame_time);
+	return 0;
+}
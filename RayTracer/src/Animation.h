@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "Scene.h"
+#include "SceneLoader.h"
+
+inline vec3 interpolate(const vec3& a, const vec3& b, float t)
+{
+	return a + (b - a) * t;
+}
+
+inline Light interpolate(const Light& a, const Light& b, float t)
+{
+	return Light(interpolate(a.position, b.position, t), a.intensity + (b.intensity - a.intensity) * t);
+}
+
+inline View interpolate(const View& a, const View& b, float t)
+{
+	View v;
+	v.position = interpolate(a.position, b.position, t);
+	v.look_at = interpolate(a.look_at, b.look_at, t);
+	v.up = interpolate(a.up, b.up, t);
+	v.fov = a.fov + (b.fov - a.fov) * t;
+	return v;
+}
+
+// Linear interpolation between keys; before the first key and after the last the value holds.
+template<typename T>
+struct Track
+{
+	std::vector<std::pair<float, T>> keys; // sorted by frame
+
+	// a second key on the same frame replaces the first
+	void add(float frame, const T& value)
+	{
+		auto it = std::lower_bound(keys.begin(), keys.end(), frame, [](const std::pair<float, T>& k, float f) { return k.first < f; });
+		if (it != keys.end() && it->first == frame)
+			it->second = value;
+		else
+			keys.insert(it, { frame, value });
+	}
+
+	T at(float frame) const
+	{
+		if (frame <= keys.front().first)
+			return keys.front().second;
+		if (frame >= keys.back().first)
+			return keys.back().second;
+		auto next = std::upper_bound(keys.begin(), keys.end(), frame, [](float f, const std::pair<float, T>& k) { return f < k.first; });
+		auto prev = next - 1;
+		return interpolate(prev->second, next->second, (frame - prev->first) / (next->first - prev->first));
+	}
+};
+
+// what Animation::apply() changed, as bits
+enum AnimationChange : unsigned
+{
+	SpheresMoved = 1,  // the BVH needs a refit
+	LightsChanged = 2, // alone, a relight() is enough
+	ViewChanged = 4,
+};
+
+// Keyframed motion for a scene, read from a text file:
+//
+//   # comments run to the end of the line
+//   frames <count>
+//   sphere <index> <frame> <center x y z>
+//   light <index> <frame> <x y z> <intensity>
+//   camera <frame> <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>
+//
+// Spheres and lights are numbered from 0 in the order the scene file lists them, also when the scene
+// is loaded from its cache. Anything without keys stays where the scene put it.
+class Animation
+{
+public:
+	int frames = 1;
+
+	bool load(const char* path)
+	{
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return fail(std::string("can not open ") + path);
+		std::string text;
+		char chunk[4096];
+		for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0; )
+			text.append(chunk, read);
+		fclose(file);
+
+		file_name = path;
+		line_number = 0;
+		for (size_t begin = 0; begin <= text.size(); ) {
+			size_t end = std::min(text.find('\n', begin), text.size());
+			line_number++;
+			if (!parseLine(text.data() + begin, text.data() + end))
+				return false;
+			begin = end + 1;
+		}
+		return true;
+	}
+
+	const std::string& error() const { return message; }
+
+	// Checks the indices against the scene and points the sphere keys at the slots the BVH build
+	// moved the spheres to; sphere_order is what prepare_scene returned, empty if nothing moved.
+	bool bind(const Scene& scene, const std::vector<uint32_t>& sphere_order)
+	{
+		std::vector<uint32_t> slot_of(sphere_order.size());
+		for (uint32_t slot = 0; slot < sphere_order.size(); ++slot)
+			slot_of[sphere_order[slot]] = slot;
+		spheres.clear();
+		for (const auto& key : sphere_keys) {
+			if (key.first >= scene.spheres.size())
+				return fail("the scene has no sphere " + std::to_string(key.first));
+			spheres.push_back({ slot_of.empty() ? key.first : slot_of[key.first], &key.second });
+		}
+		for (const auto& key : light_keys)
+			if (key.first >= scene.lights.size())
+				return fail("the scene has no light " + std::to_string(key.first));
+		return true;
+	}
+
+	// Poses the scene at `frame` and returns the AnimationChange bits of what differs from before.
+	unsigned apply(int frame, Scene& scene) const
+	{
+		float f = (float)frame;
+		unsigned change = 0;
+		for (const BoundSphere& sphere : spheres) {
+			vec3 c = sphere.track->at(f);
+			if (c.x != scene.spheres.cx[sphere.slot] || c.y != scene.spheres.cy[sphere.slot] || c.z != scene.spheres.cz[sphere.slot]) {
+				scene.spheres.cx[sphere.slot] = c.x;
+				scene.spheres.cy[sphere.slot] = c.y;
+				scene.spheres.cz[sphere.slot] = c.z;
+				change |= SpheresMoved;
+			}
+		}
+		for (const auto& key : light_keys) {
+			Light light = key.second.at(f);
+			Light& current = scene.lights[key.first];
+			if (!same(light.position, current.position) || light.intensity != current.intensity) {
+				current = light;
+				change |= LightsChanged;
+			}
+		}
+		if (!camera.keys.empty()) {
+			View view = camera.at(f);
+			View& current = scene.view;
+			if (!same(view.position, current.position) || !same(view.look_at, current.look_at) || !same(view.up, current.up) || view.fov != current.fov) {
+				current = view;
+				change |= ViewChanged;
+			}
+		}
+		return change;
+	}
+
+private:
+	struct BoundSphere
+	{
+		uint32_t slot;
+		const Track<vec3>* track;
+	};
+
+	static bool same(const vec3& a, const vec3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; }
+
+	bool parseLine(const char* begin, const char* end)
+	{
+		TextCursor c{ begin, end };
+		std::string_view keyword;
+		if (c.done() || !c.word(keyword))
+			return true;
+
+		uint32_t index;
+		float frame;
+		if (keyword == "frames") {
+			uint32_t count;
+			if (!c.integer(count) || count == 0)
+				return syntax("frames <count>");
+			frames = (int)count;
+		}
+		else if (keyword == "sphere") {
+			vec3 center;
+			if (!c.integer(index) || !c.number(frame) || !c.vector(center))
+				return syntax("sphere <index> <frame> <center x y z>");
+			sphere_keys[index].add(frame, center);
+		}
+		else if (keyword == "light") {
+			vec3 position;
+			float intensity;
+			if (!c.integer(index) || !c.number(frame) || !c.vector(position) || !c.number(intensity))
+				return syntax("light <index> <frame> <x y z> <intensity>");
+			light_keys[index].add(frame, Light(position, intensity));
+		}
+		else if (keyword == "camera") {
+			View view;
+			float fov;
+			if (!c.number(frame) || !c.vector(view.position) || !c.vector(view.look_at) || !c.vector(view.up) || !c.number(fov)
+				|| fov <= 0.0f || fov >= 180.0f)
+				return syntax("camera <frame> <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>");
+			if (!view.valid())
+				return fail_line("the camera must look at a point other than its position, not along its up vector");
+			view.fov = (float)(fov * PI / 180.0); // in double, rounded once like the (float)PI / 2 of View
+			camera.add(frame, view);
+		}
+		else {
+			return fail_line("unknown keyword '" + std::string(keyword) + "'");
+		}
+
+		if (!c.done())
+			return fail_line("unexpected text after " + std::string(keyword));
+		return true;
+	}
+
+	bool syntax(const char* usage) { return fail_line(std::string("expected ") + usage); }
+	bool fail_line(const std::string& what) { return fail(file_name + ":" + std::to_string(line_number) + ": " + what); }
+	bool fail(const std::string& what)
+	{
+		message = what;
+		return false;
+	}
+
+	std::map<uint32_t, Track<vec3>> sphere_keys;
+	std::map<uint32_t, Track<Light>> light_keys;
+	Track<View> camera;
+	std::vector<BoundSphere> spheres;
+
+	std::string file_name, message;
+	size_t line_number = 0;
+};
+
+// The file name of one frame: the pattern with the frame number in place of a %d or %0Nd, or
+// with _NNNN added before the extension when it has neither.
+inline std::string frame_path(const std::string& pattern, int frame)
+{
+	for (size_t percent = pattern.find('%'); percent != std::string::npos; percent = pattern.find('%', percent + 1)) {
+		size_t d = percent + 1;
+		while (d < pattern.size() && pattern[d] >= '0' && pattern[d] <= '9')
+			++d;
+		if (d == pattern.size() || pattern[d] != 'd')
+			continue;
+		std::string number = std::to_string(frame);
+		size_t width = d > percent + 1 ? (size_t)std::stoul(pattern.substr(percent + 1, d - percent - 1)) : 0;
+		if (number.size() < width)
+			number.insert(0, width - number.size(), '0');
+		return pattern.substr(0, percent) + number + pattern.substr(d + 1);
+	}
+	size_t dot = pattern.find_last_of("./\\");
+	if (dot == std::string::npos || pattern[dot] != '.')
+		dot = pattern.size();
+	return frame_path(pattern.substr(0, dot) + "_%04d" + pattern.substr(dot), frame);
+}
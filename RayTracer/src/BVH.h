@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "Ray.h"
+#include "Buffer.h"
+
+struct AABB
+{
+	vec3 min, max;
+
+	AABB() : min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+	AABB(const vec3& min, const vec3& max) : min(min), max(max) {}
+
+	void grow(const vec3& p)
+	{
+		min = vec3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max = vec3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+	void grow(const AABB& b) { grow(b.min); grow(b.max); }
+
+	vec3 centroid() const { return (min + max) * 0.5f; }
+	float area() const
+	{
+		vec3 e = max - min;
+		if (e.x < 0 || e.y < 0 || e.z < 0) return 0.0f; // empty box
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	// slab test, returns the entry distance or infinity if the ray misses the box within [0, tmax]
+	float intersect(const vec3& orig, const vec3& inv_dir, float tmax) const
+	{
+		float tx1 = (min.x - orig.x) * inv_dir.x, tx2 = (max.x - orig.x) * inv_dir.x;
+		float ty1 = (min.y - orig.y) * inv_dir.y, ty2 = (max.y - orig.y) * inv_dir.y;
+		float tz1 = (min.z - orig.z) * inv_dir.z, tz2 = (max.z - orig.z) * inv_dir.z;
+		float tnear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::min(tz1, tz2));
+		float tfar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+		return (tfar >= tnear && tfar >= 0.0f && tnear <= tmax) ? tnear : std::numeric_limits<float>::infinity();
+	}
+};
+
+struct BVHNode
+{
+	AABB bounds;
+	uint32_t first; // interior: index of the left child, the right one follows it; leaf: first slot in BVH::indices
+	uint32_t count; // number of primitives in a leaf, 0 for interior nodes
+};
+
+// Bounding volume hierarchy over an arbitrary list of primitive boxes, built with the binned
+// surface area heuristic. The BVH only knows boxes; the primitive test is supplied by the caller.
+class BVH
+{
+public:
+	Buffer<BVHNode> nodes;
+	std::vector<uint32_t> indices; // primitive indices in leaf order
+
+	void build(const std::vector<AABB>& prim_bounds, uint32_t max_leaf_size = 4)
+	{
+		nodes.clear();
+		indices.resize(prim_bounds.size());
+		std::iota(indices.begin(), indices.end(), 0u);
+		if (prim_bounds.empty())
+			return;
+
+		std::vector<vec3> centroids(prim_bounds.size());
+		for (size_t i = 0; i < prim_bounds.size(); ++i)
+			centroids[i] = prim_bounds[i].centroid();
+
+		nodes.reserve(2 * prim_bounds.size());
+		nodes.push_back(BVHNode());
+		subdivide(0, 0, (uint32_t)prim_bounds.size(), 0, prim_bounds, centroids, std::max(1u, max_leaf_size));
+	}
+
+	// Recomputes the boxes bottom up after the primitives moved, keeping the tree as it is. Much
+	// cheaper than a rebuild, but the further they move the looser the boxes get. leaf_bounds(i) is
+	// the box of the primitive in slot i of the leaf order. A child always comes after its parent
+	// in `nodes`, so one backward pass sees both children of a node before the node itself.
+	template<typename F>
+	void refit(F&& leaf_bounds)
+	{
+		for (size_t n = nodes.size(); n-- > 0; ) {
+			BVHNode& node = nodes[n];
+			AABB bounds;
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; ++i)
+					bounds.grow(leaf_bounds(i));
+			}
+			else {
+				bounds = nodes[node.first].bounds;
+				bounds.grow(nodes[node.first + 1].bounds);
+			}
+			node.bounds = bounds;
+		}
+	}
+
+	// Walks the nodes the ray enters before tmax, nearer child first. visit_leaf(first, count) tests
+	// indices[first, first + count) and may shrink tmax (closest hit); returning true stops the walk (any hit).
+	template<typename F>
+	void traverse(const Ray& ray, const float& tmax, F&& visit_leaf) const
+	{
+		if (nodes.empty())
+			return;
+
+		vec3 inv_dir(safe_inverse(ray.dir.x), safe_inverse(ray.dir.y), safe_inverse(ray.dir.z));
+		struct Entry { uint32_t node; float tnear; } stack[max_depth]; // at most one far child per level
+		int sp = 0;
+
+		float tnear = nodes[0].bounds.intersect(ray.orig, inv_dir, tmax);
+		if (tnear == std::numeric_limits<float>::infinity())
+			return;
+		stack[sp++] = { 0, tnear };
+
+		while (sp > 0) {
+			Entry entry = stack[--sp];
+			if (entry.tnear > tmax)
+				continue;
+			const BVHNode* node = &nodes[entry.node];
+			while (node->count == 0) {
+				uint32_t near_child = node->first, far_child = node->first + 1;
+				float t_near = nodes[near_child].bounds.intersect(ray.orig, inv_dir, tmax);
+				float t_far = nodes[far_child].bounds.intersect(ray.orig, inv_dir, tmax);
+				if (t_far < t_near) {
+					std::swap(near_child, far_child);
+					std::swap(t_near, t_far);
+				}
+				if (t_near == std::numeric_limits<float>::infinity()) {
+					node = nullptr;
+					break;
+				}
+				if (t_far != std::numeric_limits<float>::infinity())
+					stack[sp++] = { far_child, t_far };
+				node = &nodes[near_child];
+			}
+			if (node && visit_leaf(node->first, node->count))
+				return;
+		}
+	}
+
+	// Packet traversal: a node is entered if any lane in `active` hits its box within that lane's tmax,
+	// and visit_leaf(first, count, mask) gets the lanes that reached the leaf. The callback may clear
+	// bits in `active` for lanes that are finished (any hit); the walk stops once none are left.
+	template<typename F>
+	void traversePacket(const RayPacket& packet, const float* tmax, uint32_t& active, F&& visit_leaf) const
+	{
+		if (nodes.empty() || !active)
+			return;
+
+		float ix[RayPacket::size], iy[RayPacket::size], iz[RayPacket::size];
+		for (int k = 0; k < RayPacket::size; ++k) {
+			ix[k] = safe_inverse(packet.dx[k]);
+			iy[k] = safe_inverse(packet.dy[k]);
+			iz[k] = safe_inverse(packet.dz[k]);
+		}
+
+		// children are ordered along the direction of the first live ray, the packet is assumed coherent
+		int lead = 0;
+		while (!(active >> lead & 1)) ++lead;
+		vec3 lead_dir(packet.dx[lead], packet.dy[lead], packet.dz[lead]);
+
+		uint32_t stack[max_depth]; // one sibling per level, and both children of the deepest node
+		int sp = 0;
+		stack[sp++] = 0;
+		while (sp > 0 && active) {
+			const BVHNode& node = nodes[stack[--sp]];
+
+			uint32_t mask = 0;
+			for (int k = 0; k < RayPacket::size; ++k) {
+				float tx1 = (node.bounds.min.x - packet.ox[k]) * ix[k], tx2 = (node.bounds.max.x - packet.ox[k]) * ix[k];
+				float ty1 = (node.bounds.min.y - packet.oy[k]) * iy[k], ty2 = (node.bounds.max.y - packet.oy[k]) * iy[k];
+				float tz1 = (node.bounds.min.z - packet.oz[k]) * iz[k], tz2 = (node.bounds.max.z - packet.oz[k]) * iz[k];
+				float tnear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::min(tz1, tz2));
+				float tfar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::max(tz1, tz2));
+				mask |= (uint32_t)(tfar >= tnear && tfar >= 0.0f && tnear <= tmax[k]) << k;
+			}
+			mask &= active;
+			if (!mask)
+				continue;
+
+			if (node.count > 0) {
+				visit_leaf(node.first, node.count, mask);
+				continue;
+			}
+			uint32_t near_child = node.first, far_child = node.first + 1;
+			if (dot(nodes[far_child].bounds.centroid() - nodes[near_child].bounds.centroid(), lead_dir) < 0)
+				std::swap(near_child, far_child);
+			stack[sp++] = far_child;
+			stack[sp++] = near_child;
+		}
+	}
+
+private:
+	// Deepest a leaf may sit, and the size of the traversal stacks. subdivide() keeps every path
+	// within it, whatever the primitives look like.
+	static constexpr int max_depth = 64;
+	static constexpr int bin_count = 16;
+	static constexpr float traversal_cost = 1.0f; // relative to one primitive test
+
+	static float safe_inverse(float d)
+	{
+		return std::fabs(d) > 1e-20f ? 1.0f / d : std::copysign(1e20f, d);
+	}
+
+	static int ceil_log2(uint32_t n)
+	{
+		int levels = 0;
+		while (levels < 32 && (1ull << levels) < n)
+			++levels;
+		return levels;
+	}
+
+	void subdivide(uint32_t node_index, uint32_t first, uint32_t count, int depth, const std::vector<AABB>& prim_bounds, const std::vector<vec3>& centroids, uint32_t max_leaf_size)
+	{
+		AABB bounds, centroid_bounds;
+		for (uint32_t i = first; i < first + count; ++i) {
+			bounds.grow(prim_bounds[indices[i]]);
+			centroid_bounds.grow(centroids[indices[i]]);
+		}
+		nodes[node_index].bounds = bounds;
+		nodes[node_index].first = first;
+		nodes[node_index].count = count;
+		if (count == 1)
+			return;
+
+		// SAH splits can be lopsided (e.g. many clustered centroids) and chain deep. Once a balanced
+		// split of what is left would just reach max_depth, split at the median instead: that halves
+		// the count, so the subtree still fits below this node.
+		const bool deep = depth + ceil_log2(count) >= max_depth - 2;
+
+		// evaluate the SAH cost of every bin boundary on all three axes
+		int best_axis = -1, best_split = 0;
+		float best_cost = std::numeric_limits<float>::max();
+		for (int axis = 0; axis < 3 && !deep; ++axis) {
+			float lo = centroid_bounds.min[axis], extent = centroid_bounds.max[axis] - lo;
+			if (extent <= 0.0f)
+				continue;
+
+			struct Bin { AABB bounds; uint32_t count = 0; } bins[bin_count];
+			float scale = bin_count / extent;
+			for (uint32_t i = first; i < first + count; ++i) {
+				int b = std::min(bin_count - 1, int((centroids[indices[i]][axis] - lo) * scale));
+				bins[b].count++;
+				bins[b].bounds.grow(prim_bounds[indices[i]]);
+			}
+
+			float right_area[bin_count];
+			uint32_t right_count[bin_count];
+			AABB right;
+			uint32_t n = 0;
+			for (int b = bin_count - 1; b > 0; --b) {
+				right.grow(bins[b].bounds);
+				n += bins[b].count;
+				right_area[b] = right.area();
+				right_count[b] = n;
+			}
+			AABB left;
+			n = 0;
+			for (int b = 1; b < bin_count; ++b) {
+				left.grow(bins[b - 1].bounds);
+				n += bins[b - 1].count;
+				float cost = n * left.area() + right_count[b] * right_area[b];
+				if (n > 0 && right_count[b] > 0 && cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+
+		float parent_area = bounds.area();
+		float split_cost = parent_area > 0.0f ? traversal_cost + best_cost / parent_area : traversal_cost + count;
+		if (count <= max_leaf_size && (best_axis < 0 || split_cost >= (float)count))
+			return;
+
+		uint32_t* begin = &indices[first];
+		uint32_t* end = begin + count;
+		uint32_t* mid;
+		if (best_axis >= 0) {
+			float lo = centroid_bounds.min[best_axis];
+			float scale = bin_count / (centroid_bounds.max[best_axis] - lo);
+			mid = std::partition(begin, end, [&](uint32_t p) {
+				return std::min(bin_count - 1, int((centroids[p][best_axis] - lo) * scale)) < best_split;
+			});
+		}
+		else if (deep) {
+			vec3 extent = centroid_bounds.max - centroid_bounds.min;
+			int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+			mid = begin + count / 2;
+			std::nth_element(begin, mid, end, [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+		}
+		else {
+			mid = begin + count / 2; // all centroids coincide, split the list in half
+		}
+
+		uint32_t left_count = (uint32_t)(mid - begin);
+		uint32_t left_child = (uint32_t)nodes.size();
+		nodes.push_back(BVHNode());
+		nodes.push_back(BVHNode());
+		nodes[node_index].first = left_child;
+		nodes[node_index].count = 0;
+		subdivide(left_child, first, left_count, depth + 1, prim_bounds, centroids, max_leaf_size);
+		subdivide(left_child + 1, first + left_count, count - left_count, depth + 1, prim_bounds, centroids, max_leaf_size);
+	}
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Ray.h"
+#include "BVH.h"
+#include "Buffer.h"
+#include "PrimitiveSet.h"
+
+// Axis-aligned boxes, as the corner arrays of a structure of arrays.
+struct BoxSet : PrimitiveSet<BoxSet>
+{
+	Buffer<float> x0, y0, z0, x1, y1, z1;
+	Buffer<uint32_t> material;
+
+	size_t size() const { return material.size(); }
+	bool empty() const { return material.empty(); }
+
+	// min and max may be any two opposite corners, each axis is sorted here
+	void add(const vec3& min, const vec3& max, uint32_t m)
+	{
+		x0.push_back(std::min(min.x, max.x)); y0.push_back(std::min(min.y, max.y)); z0.push_back(std::min(min.z, max.z));
+		x1.push_back(std::max(min.x, max.x)); y1.push_back(std::max(min.y, max.y)); z1.push_back(std::max(min.z, max.z));
+		material.push_back(m);
+	}
+
+	uint32_t materialId(uint32_t i) const { return material[i]; }
+
+	AABB bounds(uint32_t i) const
+	{
+		vec3 min(x0[i], y0[i], z0[i]), max(x1[i], y1[i], z1[i]);
+		vec3 pad = (max - min) * 1e-4f + vec3(1e-6f);
+		return AABB(min - pad, max + pad);
+	}
+
+	void permute(const std::vector<uint32_t>& order)
+	{
+		reorder(x0, order); reorder(y0, order); reorder(z0, order);
+		reorder(x1, order); reorder(y1, order); reorder(z1, order);
+		reorder(material, order);
+	}
+
+	template<typename S, typename F>
+	static void forEachArray(S& set, F&& visit)
+	{
+		visit(set.x0); visit(set.y0); visit(set.z0);
+		visit(set.x1); visit(set.y1); visit(set.z1);
+		visit(set.material);
+	}
+
+	// slab test; from inside the box the exit distance counts, so refraction works
+	bool hit(uint32_t i, const Ray& ray, float& t) const
+	{
+		float tnear = -std::numeric_limits<float>::infinity(), tfar = std::numeric_limits<float>::infinity();
+		const float lo[3] = { x0[i], y0[i], z0[i] }, hi[3] = { x1[i], y1[i], z1[i] };
+		for (int a = 0; a < 3; ++a) {
+			if (ray.dir[a] == 0.0f) {
+				if (ray.orig[a] < lo[a] || ray.orig[a] > hi[a])
+					return false;
+				continue;
+			}
+			float t1 = (lo[a] - ray.orig[a]) / ray.dir[a], t2 = (hi[a] - ray.orig[a]) / ray.dir[a];
+			tnear = std::max(tnear, std::min(t1, t2));
+			tfar = std::min(tfar, std::max(t1, t2));
+		}
+		if (tnear > tfar || tfar <= 0.0f)
+			return false;
+		t = tnear > 0.0f ? tnear : tfar;
+		return true;
+	}
+
+	// the normal of the face the point lies on: the axis along which it is furthest out, relative to the size
+	void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3&) const
+	{
+		point = ray.at(t);
+		vec3 center((x0[i] + x1[i]) * 0.5f, (y0[i] + y1[i]) * 0.5f, (z0[i] + z1[i]) * 0.5f);
+		vec3 half((x1[i] - x0[i]) * 0.5f, (y1[i] - y0[i]) * 0.5f, (z1[i] - z0[i]) * 0.5f);
+		int axis = 0;
+		float best = -1.0f;
+		for (int a = 0; a < 3; ++a) {
+			float d = half[a] > 0.0f ? std::fabs(point[a] - center[a]) / half[a] : std::numeric_limits<float>::infinity();
+			if (d > best) {
+				best = d;
+				axis = a;
+			}
+		}
+		N = vec3(0.0f);
+		N[axis] = point[axis] < center[axis] ? -1.0f : 1.0f;
+	}
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Contiguous array with the part of the std::vector interface the scene code needs, which can
+// also be a view of elements stored elsewhere, e.g. in a memory-mapped scene cache. Element writes
+// go straight to the viewed memory; anything that changes the size copies it into owned storage first.
+template<typename T>
+class Buffer
+{
+public:
+	using value_type = T;
+
+	Buffer() = default;
+	Buffer(const Buffer& o) : storage(o.storage), ptr(o.external ? o.ptr : storage.data()), count(o.count), external(o.external) {}
+	Buffer(Buffer&& o) noexcept { swap(o); }
+	Buffer& operator=(Buffer o)
+	{
+		swap(o);
+		return *this;
+	}
+
+	// views n elements at data, which must stay valid for as long as the buffer uses them
+	void view(T* data, size_t n)
+	{
+		std::vector<T>().swap(storage);
+		ptr = data;
+		count = n;
+		external = true;
+	}
+	bool isView() const { return external; }
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T* data() { return ptr; }
+	const T* data() const { return ptr; }
+	T& operator[](size_t i) { return ptr[i]; }
+	const T& operator[](size_t i) const { return ptr[i]; }
+	T* begin() { return ptr; }
+	T* end() { return ptr + count; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+
+	void push_back(const T& v) { own(); storage.push_back(v); sync(); }
+	void reserve(size_t n) { own(); storage.reserve(n); sync(); }
+	void resize(size_t n) { own(); storage.resize(n); sync(); }
+	void clear() { own(); storage.clear(); sync(); }
+
+	void swap(Buffer& o) noexcept
+	{
+		storage.swap(o.storage);
+		std::swap(ptr, o.ptr);
+		std::swap(count, o.count);
+		std::swap(external, o.external);
+	}
+
+private:
+	void own()
+	{
+		if (!external)
+			return;
+		storage.assign(ptr, ptr + count);
+		external = false;
+	}
+	void sync()
+	{
+		ptr = storage.data();
+		count = storage.size();
+	}
+
+	std::vector<T> storage;
+	T* ptr = nullptr;
+	size_t count = 0;
+	bool external = false;
+};
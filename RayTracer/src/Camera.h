@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "Ray.h"
+
+// Pinhole camera. The image plane basis and the per-column and per-row plane offsets are
+// computed once, so generating a primary ray costs two multiply-adds and a normalization.
+class Camera
+{
+public:
+	// fov is the vertical field of view in radians; aspect defaults to width / height
+	Camera(const vec3& position, const vec3& look_at, const vec3& up, float fov, int width, int height, float aspect = 0.0f)
+		: position(position), fov(fov), width(width), height(height), aspect(aspect > 0.0f ? aspect : (float)width / height)
+	{
+		forward = (look_at - position).normalized();
+		right = cross(forward, up).normalized();
+		this->up = cross(right, forward);
+
+		float tan_half = tan(fov / 2.0f);
+		column_step = 2 / (float)width * tan_half * this->aspect;
+		row_step = -2 / (float)height * tan_half;
+		column_offset.resize(width);
+		for (int i = 0; i < width; ++i)
+			column_offset[i] = (2 * (i + 0.5f) / (float)width - 1.0f) * tan_half * this->aspect;
+		row_offset.resize(height);
+		for (int j = 0; j < height; ++j)
+			row_offset[j] = -(2 * (j + 0.5f) / (float)height - 1.0f) * tan_half;
+	}
+
+	int imageWidth() const { return width; }
+	int imageHeight() const { return height; }
+	float fieldOfView() const { return fov; }
+	float aspectRatio() const { return aspect; }
+	const vec3& origin() const { return position; }
+
+	// ray through the centre of pixel (i, j)
+	Ray ray(int i, int j) const
+	{
+		return Ray(position, direction(column_offset[i], row_offset[j]));
+	}
+
+	// ray through pixel (i, j) moved off the centre by offset, in pixels within [-0.5, 0.5)
+	Ray ray(int i, int j, const vec2& offset) const
+	{
+		return Ray(position, direction(column_offset[i] + offset.x * column_step, row_offset[j] + offset.y * row_step));
+	}
+
+	// calls emit(i, j, ray) for every pixel of [x0, x1) x [y0, y1) in scanline order
+	template<typename F>
+	void generate(int x0, int y0, int x1, int y1, F&& emit) const
+	{
+		for (int j = y0; j < y1; ++j) {
+			vec3 row = up * row_offset[j] + forward;
+			for (int i = x0; i < x1; ++i)
+				emit(i, j, Ray(position, (right * column_offset[i] + row).normalized()));
+		}
+	}
+
+private:
+	vec3 direction(float x, float y) const { return (right * x + (up * y + forward)).normalized(); }
+
+	vec3 position, forward, right, up;
+	float fov;
+	int width, height;
+	float aspect;
+	std::vector<float> column_offset, row_offset;
+	float column_step, row_step; // plane offset per pixel
+};
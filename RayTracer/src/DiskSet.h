@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Ray.h"
+#include "BVH.h"
+#include "Buffer.h"
+#include "PrimitiveSet.h"
+
+// Flat round disks: a center, a unit normal and a radius, as a structure of arrays.
+struct DiskSet : PrimitiveSet<DiskSet>
+{
+	Buffer<float> cx, cy, cz, nx, ny, nz, radius;
+	Buffer<uint32_t> material;
+
+	size_t size() const { return radius.size(); }
+	bool empty() const { return radius.empty(); }
+
+	void add(const vec3& c, const vec3& n, float r, uint32_t m)
+	{
+		vec3 u = n.normalized();
+		cx.push_back(c.x); cy.push_back(c.y); cz.push_back(c.z);
+		nx.push_back(u.x); ny.push_back(u.y); nz.push_back(u.z);
+		radius.push_back(r);
+		material.push_back(m);
+	}
+
+	vec3 center(uint32_t i) const { return vec3(cx[i], cy[i], cz[i]); }
+	vec3 normal(uint32_t i) const { return vec3(nx[i], ny[i], nz[i]); }
+	uint32_t materialId(uint32_t i) const { return material[i]; }
+
+	// along each axis the disk reaches radius * sqrt(1 - n^2) from its center
+	AABB bounds(uint32_t i) const
+	{
+		vec3 n = normal(i);
+		float r = radius[i] * 1.0001f;
+		vec3 e(r * std::sqrt(std::max(0.0f, 1.0f - n.x * n.x)), r * std::sqrt(std::max(0.0f, 1.0f - n.y * n.y)),
+			r * std::sqrt(std::max(0.0f, 1.0f - n.z * n.z)));
+		return AABB(center(i) - e, center(i) + e);
+	}
+
+	void permute(const std::vector<uint32_t>& order)
+	{
+		reorder(cx, order); reorder(cy, order); reorder(cz, order);
+		reorder(nx, order); reorder(ny, order); reorder(nz, order);
+		reorder(radius, order);
+		reorder(material, order);
+	}
+
+	template<typename S, typename F>
+	static void forEachArray(S& set, F&& visit)
+	{
+		visit(set.cx); visit(set.cy); visit(set.cz);
+		visit(set.nx); visit(set.ny); visit(set.nz);
+		visit(set.radius); visit(set.material);
+	}
+
+	bool hit(uint32_t i, const Ray& ray, float& t) const
+	{
+		vec3 n = normal(i);
+		float denom = dot(ray.dir, n);
+		if (std::fabs(denom) <= 1e-6f)
+			return false;
+		vec3 c = center(i);
+		t = dot(c - ray.orig, n) / denom;
+		vec3 d = ray.at(t) - c;
+		return t > 0.0f && dot(d, d) <= radius[i] * radius[i];
+	}
+
+	void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3&) const
+	{
+		point = ray.at(t);
+		N = normal(i);
+	}
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Camera.h"
+#include "Renderer.h"
+#include "SceneCache.h"
+#include "Socket.h"
+
+// Rendering one frame on several processes. The coordinator listens on a port and cuts the region
+// to render into tiles; workers connect at any time, receive the job (scene path, resolution and
+// render settings), load the scene and say they are ready, then get tiles one by one, render each
+// with render() on all their cores and send back the raw float pixels. Every worker keeps two tiles
+// queued so it never waits for the network between tiles, and since tiles are handed out on
+// request, fast workers simply take more of them. If a worker drops out, or once ready sends
+// nothing for `timeout` seconds (e.g. it hangs), it is dropped and its unfinished tiles go back to
+// the queue. Loading the scene may take as long as it needs; the worker holds no tiles meanwhile.
+//
+// Messages are native-endian structs; all machines must share the byte order and float format.
+
+enum class TileMessage : uint32_t
+{
+	Tile = 1,   // coordinator -> worker: TileRequest
+	Done = 2,   // coordinator -> worker: no tiles left
+	Result = 3, // worker -> coordinator: TileResult and width * height * 3 floats
+	Ready = 4,  // worker -> coordinator: the scene is loaded
+};
+
+struct DistributedJob
+{
+	uint32_t magic = 0x52544A42; // "RTJB"
+	uint32_t version = 2;
+	int32_t width = 0, height = 0;
+	int32_t samples = 1;
+	float adaptive_threshold = 0.05f;
+	float min_weight = 0.0f;
+	float roulette_weight = 0.0f;
+	uint32_t packets = 1;
+	uint32_t bilinear_environment = 0;
+	uint32_t scene_path_length = 0; // followed by the path, empty for the built-in scene
+};
+
+struct TileRequest
+{
+	TileMessage type;
+	Tile tile;
+};
+
+struct TileResult
+{
+	TileMessage type;
+	Tile tile;
+	RenderStats stats;
+};
+
+static_assert(std::is_trivially_copyable<RenderStats>::value && sizeof(vec3) == 3 * sizeof(float), "sent as raw bytes");
+
+// Renders `region` of a width x height image on the workers that connect to `port` and returns
+// once every tile is back. framebuffer receives the region, row by row. A timeout of 0 waits for
+// workers forever.
+inline bool render_coordinator(uint16_t port, const DistributedJob& job, const std::string& scene_path, const Tile& region,
+	int tile_size, double timeout, std::vector<vec3>& framebuffer, RenderStats& stats, std::string& error)
+{
+	Socket listener;
+	if (!Socket::startup() || !listener.listen(port)) {
+		error = "can not listen on port " + std::to_string(port);
+		return false;
+	}
+
+	framebuffer.assign(region.width() * region.height(), vec3(0.0f));
+	std::deque<Tile> pending;
+	tile_size = std::max(1, tile_size);
+	for (int y = region.y0; y < region.y1; y += tile_size)
+		for (int x = region.x0; x < region.x1; x += tile_size)
+			pending.push_back({ x, y, std::min(x + tile_size, region.x1), std::min(y + tile_size, region.y1) });
+	const size_t tile_count = pending.size();
+	size_t completed = 0;
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	DistributedJob header = job;
+	header.scene_path_length = (uint32_t)scene_path.size();
+
+	// one thread per connected worker
+	auto serve = [&](Socket connection, int id) {
+		std::deque<Tile> in_flight;
+		bool ok = connection.sendAll(&header, sizeof(header)) && connection.sendAll(scene_path.data(), scene_path.size());
+		// no deadline while the worker loads the scene, it holds no tiles yet; stop waiting once
+		// the others have rendered everything
+		bool ready = false;
+		while (ok && !ready) {
+			if (connection.readable(200)) {
+				TileMessage message;
+				ok = connection.receiveAll(&message, sizeof(message)) && message == TileMessage::Ready;
+				ready = ok;
+			}
+			else {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (completed == tile_count)
+					break;
+			}
+		}
+		ok = ok && connection.receiveTimeout(timeout);
+		while (ok && ready) {
+			std::vector<Tile> to_send;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (in_flight.empty())
+					changed.wait(lock, [&]() { return !pending.empty() || completed == tile_count; });
+				while (in_flight.size() < 2 && !pending.empty()) {
+					to_send.push_back(pending.front());
+					in_flight.push_back(pending.front());
+					pending.pop_front();
+				}
+				if (in_flight.empty())
+					break; // all tiles are done
+			}
+			for (const Tile& tile : to_send) {
+				TileRequest request = { TileMessage::Tile, tile };
+				ok = ok && connection.sendAll(&request, sizeof(request));
+			}
+
+			TileResult result;
+			ok = ok && connection.receiveAll(&result, sizeof(result));
+			const Tile expected = in_flight.front();
+			ok = ok && result.type == TileMessage::Result && result.tile.x0 == expected.x0 && result.tile.y0 == expected.y0
+				&& result.tile.x1 == expected.x1 && result.tile.y1 == expected.y1;
+			std::vector<vec3> pixels(ok ? expected.width() * expected.height() : 0);
+			ok = ok && connection.receiveAll(pixels.data(), pixels.size() * sizeof(vec3));
+			if (!ok)
+				break;
+
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int j = expected.y0; j < expected.y1; ++j)
+				std::copy_n(&pixels[(j - expected.y0) * expected.width()], expected.width(),
+					&framebuffer[(expected.x0 - region.x0) + (j - region.y0) * region.width()]);
+			stats += result.stats;
+			in_flight.pop_front();
+			if (++completed == tile_count)
+				changed.notify_all();
+			if (completed % 64 == 0 || completed == tile_count)
+				std::cout << completed << " / " << tile_count << " tiles" << std::endl;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (ok) {
+			TileRequest done = { TileMessage::Done, Tile{} };
+			connection.sendAll(&done, sizeof(done));
+			std::cout << "worker " << id << " finished" << std::endl;
+		}
+		else {
+			std::cout << "worker " << id << " disconnected or timed out, " << in_flight.size() << " tiles go back to the queue" << std::endl;
+			pending.insert(pending.begin(), in_flight.begin(), in_flight.end());
+			changed.notify_all();
+		}
+	};
+
+	std::cout << "coordinator: " << tile_count << " tiles, waiting for workers on port " << port << std::endl;
+	std::vector<std::thread> connections;
+	for (int id = 0;; ) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (completed == tile_count)
+				break;
+		}
+		if (!listener.readable(200))
+			continue;
+		Socket connection = listener.accept();
+		if (!connection.valid())
+			continue;
+		std::cout << "worker " << id << " connected" << std::endl;
+		connections.emplace_back(serve, std::move(connection), id++);
+	}
+	for (auto& connection : connections)
+		connection.join();
+	return true;
+}
+
+// Connects to a coordinator and renders the tiles it hands out until it says it is done.
+// `settings` supplies the local thread count and tile size; scene_override, if not empty,
+// replaces the scene path of the job (e.g. where the scene is mounted elsewhere), and
+// environment_cache is the local environment map cache directory.
+inline bool render_worker(const char* host, uint16_t port, RenderSettings settings, const std::string& scene_override,
+	const std::string& environment_cache, std::string& error)
+{
+	Socket connection;
+	if (!Socket::startup() || !connection.connect(host, port)) {
+		error = std::string("can not connect to ") + host + ":" + std::to_string(port);
+		return false;
+	}
+
+	DistributedJob job;
+	if (!connection.receiveAll(&job, sizeof(job)) || job.magic != DistributedJob().magic || job.version != DistributedJob().version) {
+		error = "the coordinator speaks a different protocol";
+		return false;
+	}
+	std::string scene_path(job.scene_path_length, '\0');
+	if (!connection.receiveAll(&scene_path[0], scene_path.size())) {
+		error = "lost the connection to the coordinator";
+		return false;
+	}
+
+	Scene scene;
+	if (!prepare_scene(scene_override.empty() ? scene_path : scene_override, scene, error, environment_cache))
+		return false;
+	scene.environment.setFilter(job.bilinear_environment ? EnvironmentMap::Filter::Bilinear : EnvironmentMap::Filter::Nearest);
+	const View& view = scene.view;
+	Camera camera(view.position, view.look_at, view.up, view.fov, job.width, job.height);
+
+	settings.samples = job.samples;
+	settings.adaptive_threshold = job.adaptive_threshold;
+	settings.min_weight = job.min_weight;
+	settings.roulette_weight = job.roulette_weight;
+	settings.packets = job.packets != 0;
+
+	TileMessage ready = TileMessage::Ready;
+	if (!connection.sendAll(&ready, sizeof(ready))) {
+		error = "lost the connection to the coordinator";
+		return false;
+	}
+
+	std::vector<vec3> pixels;
+	size_t tiles = 0;
+	for (;;) {
+		TileRequest request;
+		if (!connection.receiveAll(&request, sizeof(request))) {
+			error = "lost the connection to the coordinator";
+			return false;
+		}
+		if (request.type == TileMessage::Done)
+			break;
+
+		settings.crop = request.tile;
+		TileResult result = { TileMessage::Result, request.tile, render(scene, camera, settings, pixels) };
+		if (!connection.sendAll(&result, sizeof(result)) || !connection.sendAll(pixels.data(), pixels.size() * sizeof(vec3))) {
+			error = "lost the connection to the coordinator";
+			return false;
+		}
+		tiles++;
+	}
+	std::cout << "worker: rendered " << tiles << " tiles" << std::endl;
+	return true;
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ENVIRONMENTMAP_SSE
+#endif
+
+#include "Buffer.h"
+#include "MappedFile.h"
+#include "TileScheduler.h"
+#include "Vector.h"
+#include "stb_image.h"
+
+// header of a decoded map in the cache, followed by width * height packed float RGB texels
+struct EnvironmentCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t texel_size;
+	int32_t width, height;
+	uint64_t source_hash; // of the image file the texels were decoded from
+	uint64_t source_size;
+};
+
+// Equirectangular environment map. Lookups use polynomial approximations of atan2 and acos
+// (errors of a few 1e-6 rad, far below one texel) instead of the libm calls.
+class EnvironmentMap
+{
+public:
+	enum class Filter { Nearest, Bilinear };
+
+	// Loads an 8-bit RGB image. With a cache directory, the decoded float texels are kept there in a
+	// file named after the hash of the image file; later loads of the same image map that file
+	// instead of decoding, and the texels are read straight from the mapping.
+	bool load(const char* path, const std::string& cache_dir = std::string())
+	{
+		auto source = std::make_shared<MappedFile>();
+		if (!source->open(path))
+			return false;
+		uint64_t hash = hash_bytes(source->data(), source->size());
+		std::string cache_path = cache_dir.empty() ? std::string() : cache_dir + "/" + hex(hash) + ".rtenv";
+		cached = !cache_path.empty() && loadCache(cache_path, hash, source->size());
+		if (cached)
+			return true;
+
+		int channel = -1;
+		unsigned char* pixmap = stbi_load_from_memory(source->data(), (int)source->size(), &width, &height, &channel, 0);
+		if (!pixmap || channel != 3) {
+			stbi_image_free(pixmap);
+			return false;
+		}
+		storage.reset();
+		texels = Buffer<vec3>();
+		texels.resize((size_t)width * height);
+		convert(pixmap, texels.data(), texels.size());
+		stbi_image_free(pixmap);
+		if (!cache_path.empty())
+			saveCache(cache_path, hash, source->size());
+		return true;
+	}
+
+	// whether the last load() came from the cache
+	bool fromCache() const { return cached; }
+
+	void setFilter(Filter f) { filter = f; }
+
+	int imageWidth() const { return width; }
+	int imageHeight() const { return height; }
+
+	vec3 sample(const vec3& dir) const
+	{
+		float phi = fast_atan2(dir.z, dir.x); // [-PI, PI]
+		float theta = fast_acos(dir.y); // [0, PI]
+		/*
+		- atan2ֵ [-, ]
+			- 壺atan2 ص  X ʱת (x, z) ĽǶȣֵΪʱ뷽0  УֵΪ˳ʱ뷽-0  -У
+			- һԣ x < 0 ʱָ X Ḻ򣩣atan2 ԶǶƫ Уȷʼ [-, ] ڡ
+			- 磺
+			- ߷ X ᣨx=1, z=0  = 0
+			- ߷ X ᣨx=-1, z=0  = 
+			- ߷ Z ᣨx=0, z=1  = /2
+			- ߷ Z ᣨx=0, z=-1  = -/2
+		- acosֵ [0, ]
+			- acos(1) = 0
+			- acos(-1) = 
+		 */
+		float u = (phi + pi) * (1.0f / (2 * pi)) * width;
+		float v = theta * (1.0f / pi) * height;
+		if (filter == Filter::Nearest) {
+			// ensure x and y in range
+			int x = std::max(0, std::min(width - 1, int(u)));
+			int y = std::max(0, std::min(height - 1, int(v)));
+			return texels[x + y * width];
+		}
+
+		// bilinear: wraps around in longitude, clamps at the poles. Texel centers are at half-integers,
+		// so the neighbours are found from u - 0.5. u is at least 0, so after u += 0.5 (that is,
+		// (u - 0.5) + 1) truncating is a floor: x1 = (int)u is floor(u - 0.5) + 1 and x0 = x1 - 1
+		u += 0.5f;
+		v += 0.5f;
+		int x1 = (int)u, y1 = (int)v;
+		float s = u - x1, t = v - y1;
+		int x0 = x1 - 1, y0 = y1 - 1;
+		if (x0 < 0) x0 = width - 1;
+		if (x1 >= width) x1 -= width;
+		y0 = std::max(0, std::min(height - 1, y0));
+		y1 = std::max(0, std::min(height - 1, y1));
+		const vec3* row0 = &texels[(size_t)y0 * width];
+		const vec3* row1 = &texels[(size_t)y1 * width];
+		vec3 top = row0[x0] + (row0[x1] - row0[x0]) * s;
+		vec3 bottom = row1[x0] + (row1[x1] - row1[x0]) * s;
+		return top + (bottom - top) * t;
+	}
+
+private:
+	static constexpr float pi = 3.14159265358979323846f;
+	static constexpr char cache_magic[8] = { 'R', 'T', 'E', 'N', 'V', 'M', 'A', 'P' };
+	static constexpr uint32_t cache_version = 1;
+
+	// 8-bit RGB to floats in [0, 1], in parallel chunks, four texels per SSE step
+	static void convert(const unsigned char* in, vec3* out, size_t n)
+	{
+		static_assert(sizeof(vec3) == 3 * sizeof(float), "texels are written as packed float RGB");
+		const size_t chunk = 65536;
+		int chunks = (int)((n + chunk - 1) / chunk);
+		TileScheduler scheduler(Tile{ 0, 0, 1, std::max(1, chunks) }, 1);
+		scheduler.run([&](const Tile& tile, unsigned) {
+			size_t i = (size_t)tile.y0 * chunk, end = std::min(n, i + chunk);
+#if defined(ENVIRONMENTMAP_SSE)
+			const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+			const __m128i zero = _mm_setzero_si128();
+			float* f = &out[0].x;
+			// a 16 byte load covers the 12 bytes of four texels; stop while it stays inside the image
+			for (; i + 6 <= end; i += 4) {
+				__m128i bytes = _mm_loadu_si128((const __m128i*)(in + i * 3));
+				__m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+				_mm_storeu_ps(f + i * 3, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+				_mm_storeu_ps(f + i * 3 + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+				_mm_storeu_ps(f + i * 3 + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+			}
+#endif
+			for (; i < end; ++i)
+				out[i] = vec3(in[i * 3 + 0], in[i * 3 + 1], in[i * 3 + 2]) * (1.0f / 255.0f);
+		});
+	}
+
+	// 64-bit multiply-xorshift hash over 8-byte words; identifies the image file, not a security measure
+	static uint64_t hash_bytes(const uint8_t* data, size_t size)
+	{
+		const uint64_t k = 0x9E3779B97F4A7C15ull;
+		uint64_t h = size * k;
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t w;
+			memcpy(&w, data + i, 8);
+			h = (h ^ (w * k)) * 0xBF58476D1CE4E5B9ull;
+			h ^= h >> 31;
+		}
+		uint64_t tail = 0;
+		memcpy(&tail, data + i, size - i);
+		h = (h ^ (tail * k)) * 0x94D049BB133111EBull;
+		return h ^ (h >> 29);
+	}
+
+	static std::string hex(uint64_t h)
+	{
+		char text[17];
+		snprintf(text, sizeof(text), "%016llx", (unsigned long long)h);
+		return text;
+	}
+
+	bool loadCache(const std::string& cache_path, uint64_t hash, uint64_t source_size)
+	{
+		auto file = std::make_shared<MappedFile>();
+		if (!file->open(cache_path.c_str()) || file->size() < sizeof(EnvironmentCacheHeader))
+			return false;
+		EnvironmentCacheHeader header;
+		memcpy(&header, file->data(), sizeof(header));
+		if (memcmp(header.magic, cache_magic, sizeof(header.magic)) != 0 || header.version != cache_version
+			|| header.texel_size != sizeof(vec3) || header.source_hash != hash || header.source_size != source_size
+			|| header.width <= 0 || header.height <= 0
+			|| file->size() != sizeof(header) + sizeof(vec3) * (uint64_t)header.width * header.height)
+			return false;
+		width = header.width;
+		height = header.height;
+		texels.view((vec3*)(file->data() + sizeof(header)), (size_t)width * height);
+		storage = file;
+		return true;
+	}
+
+	// written under a temporary name and renamed, so that concurrent jobs never see half a file
+	void saveCache(const std::string& cache_path, uint64_t hash, uint64_t source_size) const
+	{
+		EnvironmentCacheHeader header = {};
+		memcpy(header.magic, cache_magic, sizeof(header.magic));
+		header.version = cache_version;
+		header.texel_size = sizeof(vec3);
+		header.width = width;
+		header.height = height;
+		header.source_hash = hash;
+		header.source_size = source_size;
+
+		std::string temporary = cache_path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (!file)
+			return;
+		bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(texels.data(), sizeof(vec3), texels.size(), file) == texels.size();
+		ok = fclose(file) == 0 && ok;
+		if (!ok || std::rename(temporary.c_str(), cache_path.c_str()) != 0)
+			std::remove(temporary.c_str());
+	}
+
+	static float fast_atan2(float y, float x)
+	{
+		float ax = std::fabs(x), ay = std::fabs(y);
+		float hi = std::max(ax, ay), lo = std::min(ax, ay);
+		if (hi == 0.0f)
+			return 0.0f;
+		float a = lo / hi;
+		float s = a * a;
+		float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+		if (ay > ax) r = 0.5f * pi - r;
+		if (x < 0) r = pi - r;
+		return y < 0 ? -r : r;
+	}
+
+	// Abramowitz & Stegun 4.4.46
+	static float fast_acos(float x)
+	{
+		x = std::max(-1.0f, std::min(1.0f, x));
+		float ax = std::fabs(x);
+		float r = -0.0012624911f;
+		r = r * ax + 0.0066700901f;
+		r = r * ax - 0.0170881256f;
+		r = r * ax + 0.0308918810f;
+		r = r * ax - 0.0501743046f;
+		r = r * ax + 0.0889789874f;
+		r = r * ax - 0.2145988016f;
+		r = r * ax + 1.5707963050f;
+		r *= std::sqrt(1.0f - ax);
+		return x < 0 ? pi - r : r;
+	}
+
+	int width = 0, height = 0;
+	Buffer<vec3> texels;
+	std::shared_ptr<MappedFile> storage; // backs texels when they come from the cache
+	bool cached = false;
+	Filter filter = Filter::Nearest;
+};
@@ -0,0 +1,289 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JpegWriter.h"
+#include "TileScheduler.h"
+#include "ToneMap.h"
+#include "Vector.h"
+#include "stb_image_write.h"
+
+// Output stage. The 8-bit formats go through the ToneMapper; the float formats store the linear
+// radiance as rendered, for compositing downstream, and skip both quantization and JPEG encoding.
+//   jpg  8-bit JPEG at quality 100, strips encoded in parallel (JpegWriter)
+//   png  8-bit PNG
+//   hdr  Radiance RGBE (stbi_write_hdr)
+//   pfm  portable float map, 32-bit float RGB
+//   raw  headerless 32-bit float RGB in native byte order, rows top to bottom
+enum class ImageFormat { Jpeg, Png, Hdr, Pfm, Raw };
+
+// receives the encoded bytes in order; the same signature as stb_image_write's callbacks
+using ImageSink = stbi_write_func;
+
+inline bool parse_image_format(const char* name, ImageFormat& format)
+{
+	static const struct { const char* name; ImageFormat format; } names[] = {
+		{ "jpg", ImageFormat::Jpeg }, { "jpeg", ImageFormat::Jpeg }, { "png", ImageFormat::Png },
+		{ "hdr", ImageFormat::Hdr }, { "pfm", ImageFormat::Pfm }, { "raw", ImageFormat::Raw },
+	};
+	for (const auto& n : names) {
+		if (!strcmp(name, n.name)) {
+			format = n.format;
+			return true;
+		}
+	}
+	return false;
+}
+
+// by file extension, JPEG when it is not one of the above
+inline ImageFormat image_format_for(const std::string& path)
+{
+	size_t dot = path.find_last_of("./\\");
+	ImageFormat format = ImageFormat::Jpeg;
+	if (dot != std::string::npos && path[dot] == '.')
+		parse_image_format(path.c_str() + dot + 1, format);
+	return format;
+}
+
+inline bool is_float_format(ImageFormat format)
+{
+	return format == ImageFormat::Hdr || format == ImageFormat::Pfm || format == ImageFormat::Raw;
+}
+
+inline void write_strips(const JpegWriter& writer, const std::vector<std::vector<uint8_t>>& strips, ImageSink* sink, void* context)
+{
+	std::vector<uint8_t> header = writer.header(), trailer = JpegWriter::trailer();
+	sink(context, header.data(), (int)header.size());
+	for (const auto& strip : strips)
+		sink(context, (void*)strip.data(), (int)strip.size());
+	sink(context, trailer.data(), (int)trailer.size());
+}
+
+// Encodes the strips of a JPEG on `threads` workers. strip_rows(strip, scratch) returns the 8-bit
+// rows of the strip, either pointing into an existing pixmap or tone mapped into scratch.
+template<typename R>
+bool encode_jpeg(int width, int height, unsigned threads, R&& strip_rows, ImageSink* sink, void* context)
+{
+	JpegWriter writer(width, height);
+	if (!writer.valid())
+		return false;
+	std::vector<std::vector<uint8_t>> strips(writer.stripCount());
+	TileScheduler scheduler(Tile{ 0, 0, 1, writer.stripCount() }, 1, threads);
+	std::vector<std::vector<unsigned char>> scratch(scheduler.threadCount());
+	scheduler.run([&](const Tile& tile, unsigned worker) {
+		writer.encodeStrip(tile.y0, strip_rows(tile.y0, scratch[worker]), strips[tile.y0]);
+	});
+	write_strips(writer, strips, sink, context);
+	return true;
+}
+
+// encodes an 8-bit image that the ToneMapper produced
+inline bool encode_pixmap(ImageFormat format, int width, int height, const unsigned char* pixmap, ImageSink* sink, void* context,
+	unsigned threads = 0)
+{
+	switch (format) {
+	case ImageFormat::Jpeg:
+		return encode_jpeg(width, height, threads, [&](int strip, std::vector<unsigned char>&) {
+			return pixmap + (size_t)strip * 8 * width * 3;
+		}, sink, context);
+	case ImageFormat::Png: return stbi_write_png_to_func(sink, context, width, height, 3, pixmap, width * 3) != 0;
+	default: return false;
+	}
+}
+
+// encodes linear radiance as is
+inline bool encode_radiance(ImageFormat format, int width, int height, const vec3* pixels, ImageSink* sink, void* context)
+{
+	static_assert(sizeof(vec3) == 3 * sizeof(float), "pixels are written as packed float RGB");
+	const float* data = &pixels[0].x;
+	int row_bytes = width * (int)sizeof(vec3);
+	switch (format) {
+	case ImageFormat::Hdr:
+		return stbi_write_hdr_to_func(sink, context, width, height, 3, data) != 0;
+	case ImageFormat::Pfm: {
+		// the sign of the scale gives the byte order, rows go bottom to top
+		const uint32_t one = 1;
+		bool little_endian = *(const uint8_t*)&one == 1;
+		std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + (little_endian ? "\n-1.0\n" : "\n1.0\n");
+		sink(context, &header[0], (int)header.size());
+		for (int j = height - 1; j >= 0; --j)
+			sink(context, (void*)(pixels + (size_t)j * width), row_bytes);
+		return true;
+	}
+	case ImageFormat::Raw:
+		for (int j = 0; j < height; ++j)
+			sink(context, (void*)(pixels + (size_t)j * width), row_bytes);
+		return true;
+	default:
+		return false;
+	}
+}
+
+inline bool encode_image(ImageFormat format, int width, int height, const std::vector<vec3>& framebuffer, const ToneMapper& mapper,
+	ImageSink* sink, void* context)
+{
+	if (is_float_format(format))
+		return encode_radiance(format, width, height, framebuffer.data(), sink, context);
+	if (format == ImageFormat::Jpeg) {
+		// tone mapping fused into the strips: each worker maps 8 rows and encodes them right away
+		return encode_jpeg(width, height, mapper.config().threads, [&](int strip, std::vector<unsigned char>& scratch) {
+			int rows = std::min(8, height - strip * 8);
+			scratch.resize((size_t)rows * width * 3);
+			mapper.map(&framebuffer[(size_t)strip * 8 * width], (size_t)rows * width, scratch.data());
+			return scratch.data();
+		}, sink, context);
+	}
+	std::vector<unsigned char> pixmap;
+	mapper(framebuffer, pixmap);
+	return encode_pixmap(format, width, height, pixmap.data(), sink, context);
+}
+
+// Encodes a JPEG while the image is still being rendered: pass rowsDone() to render() and every
+// strip of 8 rows is tone mapped and encoded by the worker that finished its last row. finish()
+// then only has the strips left over to encode, if any, before writing them out.
+class JpegStream
+{
+public:
+	JpegStream(int width, int height, const std::vector<vec3>& framebuffer, const ToneMapper& mapper)
+		: width(width), writer(width, height), framebuffer(framebuffer), mapper(mapper), strips(writer.stripCount()), rows_left(writer.stripCount())
+	{
+		for (int k = 0; k < writer.stripCount(); ++k)
+			rows_left[k] = writer.stripRows(k);
+	}
+
+	bool valid() const { return writer.valid(); }
+
+	// rows [y0, y1) of the framebuffer are final; called from several threads at once
+	void rowsDone(int y0, int y1)
+	{
+		for (int y = y0; y < y1; ++y)
+			if (rows_left[y / 8].fetch_sub(1) == 1)
+				encode(y / 8);
+	}
+
+	bool finish(ImageSink* sink, void* context)
+	{
+		if (!writer.valid())
+			return false;
+		for (int k = 0; k < writer.stripCount(); ++k)
+			if (rows_left[k] > 0)
+				encode(k);
+		write_strips(writer, strips, sink, context);
+		return true;
+	}
+
+private:
+	void encode(int strip)
+	{
+		int rows = writer.stripRows(strip);
+		std::vector<unsigned char> pixmap((size_t)rows * width * 3);
+		mapper.map(&framebuffer[(size_t)strip * 8 * width], (size_t)rows * width, pixmap.data());
+		writer.encodeStrip(strip, pixmap.data(), strips[strip]);
+		rows_left[strip] = 0;
+	}
+
+	int width;
+	JpegWriter writer;
+	const std::vector<vec3>& framebuffer;
+	const ToneMapper& mapper;
+	std::vector<std::vector<uint8_t>> strips;
+	std::vector<std::atomic<int>> rows_left;
+};
+
+// writes whatever encode(sink, context) produces to the file at path
+inline bool write_file(const char* path, const std::function<bool(ImageSink*, void*)>& encode)
+{
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	struct Output { FILE* file; bool ok; } output = { file, true };
+	bool ok = encode([](void* context, void* data, int size) {
+		Output& out = *(Output*)context;
+		out.ok = out.ok && fwrite(data, 1, (size_t)size, out.file) == (size_t)size;
+	}, &output);
+	ok = fclose(file) == 0 && ok && output.ok;
+	return ok;
+}
+
+inline bool write_image(const char* path, ImageFormat format, int width, int height, const std::vector<vec3>& framebuffer,
+	const ToneMapper& mapper = ToneMapper())
+{
+	return write_file(path, [&](ImageSink* sink, void* context) {
+		return encode_image(format, width, height, framebuffer, mapper, sink, context);
+	});
+}
+
+// Writes images on a thread of its own while the caller renders the next one. One image is in
+// flight at a time: write() waits for the previous one to be on disk before taking the next.
+class BackgroundWriter
+{
+public:
+	BackgroundWriter(ImageFormat format, int width, int height, const ToneMapper& mapper)
+		: format(format), width(width), height(height), mapper(mapper) {}
+	~BackgroundWriter() { finish(); }
+
+	// takes the framebuffer, leaving a spare one of no particular content in its place
+	void write(const std::string& path, std::vector<vec3>& framebuffer)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]() { return !pending; });
+		this->path = path;
+		image.swap(framebuffer);
+		pending = true;
+		if (!thread.joinable())
+			thread = std::thread([this]() { run(); });
+		changed.notify_all();
+	}
+
+	// waits for the last image; returns the paths that could not be written
+	std::vector<std::string> finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			changed.notify_all();
+		}
+		if (thread.joinable())
+			thread.join();
+		return failed;
+	}
+
+private:
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			changed.wait(lock, [&]() { return pending || stopping; });
+			if (!pending)
+				return;
+			lock.unlock();
+			bool ok = write_image(path.c_str(), format, width, height, image, mapper);
+			lock.lock();
+			if (!ok)
+				failed.push_back(path);
+			pending = false;
+			changed.notify_all();
+		}
+	}
+
+	ImageFormat format;
+	int width, height;
+	ToneMapper mapper;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool pending = false, stopping = false;
+	std::string path;
+	std::vector<vec3> image;
+	std::vector<std::string> failed;
+};
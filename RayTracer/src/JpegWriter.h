@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// Baseline JPEG encoder that cuts the scan into restart intervals of one row of 8 x 8 blocks (a
+// strip of 8 pixel rows). Every strip starts from fresh DC predictors and a byte boundary, so the
+// strips can be encoded independently, on any thread and in any order, and simply concatenated:
+// header(), the strips in order, trailer().
+//
+// The colour conversion, DCT, quantization and Huffman tables are those of stb_image_write's
+// writer (4:4:4, the standard tables scaled by quality), computed the same way, so the image
+// decodes to exactly the pixels stbi_write_jpg would have produced.
+class JpegWriter
+{
+public:
+	JpegWriter(int width, int height, int quality = 100) : width(width), height(height)
+	{
+		static const int YQT[] = { 16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,18,22,
+			37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99 };
+		static const int UVQT[] = { 17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,
+			99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
+		static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+			1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+
+		quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+		quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+		for (int i = 0; i < 64; ++i) {
+			int yti = (YQT[i] * quality + 50) / 100, uvti = (UVQT[i] * quality + 50) / 100;
+			y_table[zigzag[i]] = (uint8_t)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+			uv_table[zigzag[i]] = (uint8_t)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+		}
+		for (int row = 0, k = 0; row < 8; ++row)
+			for (int col = 0; col < 8; ++col, ++k) {
+				fdtbl_y[k] = 1 / (y_table[zigzag[k]] * aasf[row] * aasf[col]);
+				fdtbl_uv[k] = 1 / (uv_table[zigzag[k]] * aasf[row] * aasf[col]);
+			}
+
+		build_codes(dc_luminance_counts, dc_luminance_values, y_dc);
+		build_codes(ac_luminance_counts, ac_luminance_values, y_ac);
+		build_codes(dc_chrominance_counts, dc_chrominance_values, uv_dc);
+		build_codes(ac_chrominance_counts, ac_chrominance_values, uv_ac);
+	}
+
+	// JPEG stores 16-bit sizes, and the restart interval is a row of blocks
+	bool valid() const { return width > 0 && height > 0 && width <= 65535 && height <= 65535; }
+
+	int stripCount() const { return (height + 7) / 8; }
+	int stripRows(int strip) const { return std::min(8, height - strip * 8); }
+
+	// everything up to the start of the scan
+	std::vector<uint8_t> header() const
+	{
+		std::vector<uint8_t> out = { 0xFF,0xD8, 0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+		// quantization tables
+		append(out, { 0xFF,0xDB,0,0x84,0 });
+		out.insert(out.end(), y_table, y_table + 64);
+		out.push_back(1);
+		out.insert(out.end(), uv_table, uv_table + 64);
+		// frame: 8 bits, 3 components at full resolution
+		append(out, { 0xFF,0xC0,0,0x11,8,(uint8_t)(height >> 8),(uint8_t)height,(uint8_t)(width >> 8),(uint8_t)width, 3,1,0x11,0,2,0x11,1,3,0x11,1 });
+		// Huffman tables
+		append(out, { 0xFF,0xC4,0x01,0xA2,0 });
+		out.insert(out.end(), dc_luminance_counts, dc_luminance_counts + 16);
+		out.insert(out.end(), dc_luminance_values, dc_luminance_values + 12);
+		out.push_back(0x10);
+		out.insert(out.end(), ac_luminance_counts, ac_luminance_counts + 16);
+		out.insert(out.end(), ac_luminance_values, ac_luminance_values + 162);
+		out.push_back(1);
+		out.insert(out.end(), dc_chrominance_counts, dc_chrominance_counts + 16);
+		out.insert(out.end(), dc_chrominance_values, dc_chrominance_values + 12);
+		out.push_back(0x11);
+		out.insert(out.end(), ac_chrominance_counts, ac_chrominance_counts + 16);
+		out.insert(out.end(), ac_chrominance_values, ac_chrominance_values + 162);
+		// restart interval: one row of blocks
+		int interval = (width + 7) / 8;
+		append(out, { 0xFF,0xDD,0,4,(uint8_t)(interval >> 8),(uint8_t)interval });
+		append(out, { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 });
+		return out;
+	}
+
+	static std::vector<uint8_t> trailer() { return { 0xFF, 0xD9 }; }
+
+	// Appends strip `strip` to out. rows holds its stripRows() rows as packed 8-bit RGB; the edge
+	// pixels are repeated to fill the blocks that stick out of the image.
+	void encodeStrip(int strip, const unsigned char* rows, std::vector<uint8_t>& out) const
+	{
+		BitWriter bits(out);
+		int dc_y = 0, dc_u = 0, dc_v = 0;
+		int row_count = stripRows(strip);
+		for (int x = 0; x < width; x += 8) {
+			float ydu[64], udu[64], vdu[64];
+			for (int row = 0, pos = 0; row < 8; ++row)
+				for (int col = x; col < x + 8; ++col, ++pos) {
+					const unsigned char* p = rows + (std::min(row, row_count - 1) * width + std::min(col, width - 1)) * 3;
+					float r = p[0], g = p[1], b = p[2];
+					ydu[pos] = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+					udu[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+					vdu[pos] = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+				}
+			dc_y = encodeBlock(bits, ydu, fdtbl_y, dc_y, y_dc, y_ac);
+			dc_u = encodeBlock(bits, udu, fdtbl_uv, dc_u, uv_dc, uv_ac);
+			dc_v = encodeBlock(bits, vdu, fdtbl_uv, dc_v, uv_dc, uv_ac);
+		}
+		bits.write({ 0x7F, 7 }); // pad to a byte boundary with ones
+		if (strip + 1 < stripCount()) {
+			out.push_back(0xFF);
+			out.push_back((uint8_t)(0xD0 + strip % 8)); // RSTn
+		}
+	}
+
+private:
+	struct Code { uint16_t bits, length; };
+
+	struct BitWriter
+	{
+		std::vector<uint8_t>& out;
+		int buffer = 0, count = 0;
+
+		explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+		void write(Code c)
+		{
+			count += c.length;
+			buffer |= c.bits << (24 - count);
+			while (count >= 8) {
+				uint8_t byte = (buffer >> 16) & 255;
+				out.push_back(byte);
+				if (byte == 255)
+					out.push_back(0); // byte stuffing
+				buffer <<= 8;
+				count -= 8;
+			}
+		}
+	};
+
+	static void append(std::vector<uint8_t>& out, std::initializer_list<uint8_t> bytes) { out.insert(out.end(), bytes); }
+
+	// canonical Huffman codes from the code counts per length and the symbols in code order
+	static void build_codes(const uint8_t* counts, const uint8_t* values, Code* table)
+	{
+		uint16_t code = 0;
+		for (int length = 1, k = 0; length <= 16; ++length) {
+			for (int n = 0; n < counts[length - 1]; ++n, ++k)
+				table[values[k]] = { code++, (uint16_t)length };
+			code <<= 1;
+		}
+	}
+
+	static Code magnitude(int value)
+	{
+		int a = value < 0 ? -value : value;
+		value = value < 0 ? value - 1 : value;
+		uint16_t length = 1;
+		while (a >>= 1)
+			++length;
+		return { (uint16_t)(value & ((1 << length) - 1)), length };
+	}
+
+	static void dct(float* d0p, float* d1p, float* d2p, float* d3p, float* d4p, float* d5p, float* d6p, float* d7p)
+	{
+		float d0 = *d0p, d1 = *d1p, d2 = *d2p, d3 = *d3p, d4 = *d4p, d5 = *d5p, d6 = *d6p, d7 = *d7p;
+		float tmp0 = d0 + d7, tmp7 = d0 - d7, tmp1 = d1 + d6, tmp6 = d1 - d6;
+		float tmp2 = d2 + d5, tmp5 = d2 - d5, tmp3 = d3 + d4, tmp4 = d3 - d4;
+
+		// even part
+		float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3, tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+		d0 = tmp10 + tmp11;
+		d4 = tmp10 - tmp11;
+		float z1 = (tmp12 + tmp13) * 0.707106781f;
+		d2 = tmp13 + z1;
+		d6 = tmp13 - z1;
+
+		// odd part
+		tmp10 = tmp4 + tmp5;
+		tmp11 = tmp5 + tmp6;
+		tmp12 = tmp6 + tmp7;
+		float z5 = (tmp10 - tmp12) * 0.382683433f;
+		float z2 = tmp10 * 0.541196100f + z5;
+		float z4 = tmp12 * 1.306562965f + z5;
+		float z3 = tmp11 * 0.707106781f;
+		float z11 = tmp7 + z3, z13 = tmp7 - z3;
+
+		*d5p = z13 + z2;
+		*d3p = z13 - z2;
+		*d1p = z11 + z4;
+		*d7p = z11 - z4;
+		*d0p = d0; *d2p = d2; *d4p = d4; *d6p = d6;
+	}
+
+	// transforms, quantizes and entropy codes one 8 x 8 block, returns its DC for the next prediction
+	static int encodeBlock(BitWriter& bits, float* cdu, const float* fdtbl, int dc, const Code* dc_codes, const Code* ac_codes)
+	{
+		for (int off = 0; off < 64; off += 8)
+			dct(&cdu[off], &cdu[off + 1], &cdu[off + 2], &cdu[off + 3], &cdu[off + 4], &cdu[off + 5], &cdu[off + 6], &cdu[off + 7]);
+		for (int off = 0; off < 8; ++off)
+			dct(&cdu[off], &cdu[off + 8], &cdu[off + 16], &cdu[off + 24], &cdu[off + 32], &cdu[off + 40], &cdu[off + 48], &cdu[off + 56]);
+		int du[64];
+		for (int i = 0; i < 64; ++i) {
+			float v = cdu[i] * fdtbl[i];
+			du[zigzag[i]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+		}
+
+		int diff = du[0] - dc;
+		if (diff == 0) {
+			bits.write(dc_codes[0]);
+		}
+		else {
+			Code m = magnitude(diff);
+			bits.write(dc_codes[m.length]);
+			bits.write(m);
+		}
+
+		int end = 63;
+		while (end > 0 && du[end] == 0)
+			--end;
+		for (int i = 1; i <= end; ++i) {
+			int start = i;
+			while (i <= end && du[i] == 0)
+				++i;
+			int zeros = i - start;
+			for (int n = 0; n < zeros >> 4; ++n)
+				bits.write(ac_codes[0xF0]); // 16 zeros
+			zeros &= 15;
+			Code m = magnitude(du[i]);
+			bits.write(ac_codes[(zeros << 4) + m.length]);
+			bits.write(m);
+		}
+		if (end != 63)
+			bits.write(ac_codes[0x00]); // end of block
+		return du[0];
+	}
+
+	static constexpr uint8_t zigzag[64] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,
+		24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
+
+	static constexpr uint8_t dc_luminance_counts[16] = { 0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+	static constexpr uint8_t dc_luminance_values[12] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+	static constexpr uint8_t ac_luminance_counts[16] = { 0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+	static constexpr uint8_t ac_luminance_values[162] = {
+		0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+		0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+		0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+		0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+		0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+		0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+		0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa };
+	static constexpr uint8_t dc_chrominance_counts[16] = { 0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+	static constexpr uint8_t dc_chrominance_values[12] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+	static constexpr uint8_t ac_chrominance_counts[16] = { 0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+	static constexpr uint8_t ac_chrominance_values[162] = {
+		0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+		0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+		0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+		0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+		0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+		0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+		0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,0xf9,0xfa };
+
+	int width, height;
+	uint8_t y_table[64], uv_table[64];
+	float fdtbl_y[64], fdtbl_uv[64];
+	Code y_dc[256] = {}, y_ac[256] = {}, uv_dc[256] = {}, uv_ac[256] = {};
+};
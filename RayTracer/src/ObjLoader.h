@@ -0,0 +1,182 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "MappedFile.h"
+#include "TextCursor.h"
+#include "TriangleSet.h"
+
+// Reads the geometry of a Wavefront OBJ file: v, vn and f lines. Faces may give their corners as
+// v, v/vt, v//vn or v/vt/vn, with negative indices counting back from the last vertex; polygons
+// are split into fans. Texture coordinates, groups, smoothing groups and .mtl materials are
+// ignored, the whole mesh gets one scene material. Corners without a normal get the area weighted
+// average of the face normals around their vertex. The file is mapped and parsed in place.
+class ObjLoader
+{
+public:
+	// adds the mesh to `triangles`, every position scaled by `scale` and then moved by `offset`
+	bool load(const char* path, TriangleSet& triangles, uint32_t material, float scale, const vec3& offset)
+	{
+		MappedFile file;
+		if (!file.open(path))
+			return fail(std::string("can not open ") + path);
+		file_name = path;
+		positions.clear();
+		normals.clear();
+		corners.clear();
+
+		const char* line = (const char*)file.data();
+		const char* end = line + file.size();
+		line_number = 0;
+		while (line < end) {
+			const char* newline = (const char*)memchr(line, '\n', end - line);
+			const char* line_end = newline ? newline : end;
+			line_number++;
+			if (!parseLine(line, line_end))
+				return false;
+			line = line_end + 1;
+		}
+		if (corners.empty())
+			return fail(file_name + ": no faces");
+
+		// the normals of corners without one, per vertex
+		std::vector<vec3> vertex_normals;
+		bool missing = false;
+		for (const Corner& corner : corners)
+			missing = missing || corner.normal == UINT32_MAX;
+		if (missing) {
+			vertex_normals.assign(positions.size(), vec3(0.0f));
+			for (size_t i = 0; i < corners.size(); i += 3) {
+				const vec3 &a = positions[corners[i].position], &b = positions[corners[i + 1].position], &c = positions[corners[i + 2].position];
+				vec3 n = cross(b - a, c - a); // its length is twice the area
+				for (int k = 0; k < 3; ++k)
+					vertex_normals[corners[i + k].position] = vertex_normals[corners[i + k].position] + n;
+			}
+		}
+
+		uint32_t normal_base = (uint32_t)triangles.normals.size();
+		uint32_t vertex_base = normal_base + (uint32_t)normals.size();
+		triangles.normals.reserve(vertex_base + vertex_normals.size());
+		for (const vec3& n : normals)
+			triangles.normals.push_back(unit(n));
+		for (const vec3& n : vertex_normals)
+			triangles.normals.push_back(unit(n));
+
+		triangles.reserve(triangles.size() + corners.size() / 3);
+		for (size_t i = 0; i < corners.size(); i += 3) {
+			uint32_t n[3];
+			for (int k = 0; k < 3; ++k) {
+				const Corner& corner = corners[i + k];
+				n[k] = corner.normal != UINT32_MAX ? normal_base + corner.normal : vertex_base + corner.position;
+			}
+			triangles.add(positions[corners[i].position] * scale + offset, positions[corners[i + 1].position] * scale + offset,
+				positions[corners[i + 2].position] * scale + offset, n[0], n[1], n[2], material);
+		}
+		return true;
+	}
+
+	const std::string& error() const { return message; }
+
+private:
+	struct Corner
+	{
+		uint32_t position, normal; // normal is UINT32_MAX if the face gives none
+	};
+
+	static vec3 unit(const vec3& n)
+	{
+		return n.norm() > 0.0f ? n.normalized() : vec3(0.0f, 0.0f, 1.0f);
+	}
+
+	bool parseLine(const char* begin, const char* end)
+	{
+		TextCursor c{ begin, end };
+		std::string_view keyword;
+		if (c.done() || !c.word(keyword))
+			return true;
+
+		if (keyword == "v") {
+			vec3 p;
+			if (!c.vector(p))
+				return fail_line("expected v <x y z>");
+			positions.push_back(p); // an optional w is ignored
+		}
+		else if (keyword == "vn") {
+			vec3 n;
+			if (!c.vector(n))
+				return fail_line("expected vn <x y z>");
+			normals.push_back(n);
+		}
+		else if (keyword == "f") {
+			Corner first, previous, corner;
+			int count = 0;
+			for (std::string_view token; !c.done() && c.word(token); ++count) {
+				if (!parseCorner(token, corner))
+					return fail_line("bad face corner '" + std::string(token) + "'");
+				if (count >= 2) {
+					corners.push_back(first);
+					corners.push_back(previous);
+					corners.push_back(corner);
+				}
+				(count == 0 ? first : previous) = corner;
+			}
+			if (count < 3)
+				return fail_line("a face needs at least three corners");
+		}
+		// vt, o, g, s, usemtl, mtllib, l, p and the rest are not needed
+		return true;
+	}
+
+	// v, v/vt, v//vn or v/vt/vn
+	bool parseCorner(std::string_view token, Corner& corner) const
+	{
+		const char* p = token.data();
+		const char* end = p + token.size();
+		int64_t v, vn;
+		if (!index(p, end, positions.size(), v))
+			return false;
+		corner.position = (uint32_t)v;
+		corner.normal = UINT32_MAX;
+		if (p == end)
+			return true;
+		if (*p++ != '/')
+			return false;
+		while (p < end && *p != '/')
+			++p; // texture coordinate
+		if (p == end)
+			return true;
+		++p;
+		if (!index(p, end, normals.size(), vn))
+			return false;
+		corner.normal = (uint32_t)vn;
+		return p == end;
+	}
+
+	// a 1-based or negative (relative) OBJ index into a list of `size` items, as a 0-based index
+	static bool index(const char*& p, const char* end, size_t size, int64_t& i)
+	{
+		std::from_chars_result r = std::from_chars(p, end, i);
+		if (r.ec != std::errc())
+			return false;
+		p = r.ptr;
+		i = i < 0 ? (int64_t)size + i : i - 1;
+		return i >= 0 && i < (int64_t)size;
+	}
+
+	bool fail_line(const std::string& what) { return fail(file_name + ":" + std::to_string(line_number) + ": " + what); }
+	bool fail(const std::string& what)
+	{
+		message = what;
+		return false;
+	}
+
+	std::vector<vec3> positions, normals;
+	std::vector<Corner> corners; // three per triangle
+	std::string file_name, message;
+	size_t line_number = 0;
+};
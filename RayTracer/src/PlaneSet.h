@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "Ray.h"
+#include "BVH.h"
+#include "Buffer.h"
+#include "PrimitiveSet.h"
+
+// The plane dot(normal, p) + offset = 0, limited to the points strictly inside `bounds`. With a
+// non-zero checker_scale the diffuse colour alternates with checker_color in squares of side
+// 1 / checker_scale, laid out along the two axes the normal is least aligned with.
+struct Plane
+{
+	Plane(const vec3& n, float offset, uint32_t material) : normal(n.normalized()), offset(offset / n.norm()), material(material),
+		bounds(vec3(-std::numeric_limits<float>::infinity()), vec3(std::numeric_limits<float>::infinity())) {}
+	vec3 normal;
+	float offset;
+	uint32_t material;
+	AABB bounds;
+	float checker_scale = 0.0f;
+	vec3 checker_color;
+
+	bool hit(const Ray& ray, float& d, vec3& pt) const
+	{
+		float denom = dot(ray.dir, normal);
+		if (fabs(denom) <= 1e-3)
+			return false;
+		d = -(dot(ray.orig, normal) + offset) / denom;
+		pt = ray.orig + ray.dir * d;
+		return d > 0 && pt.x > bounds.min.x && pt.x < bounds.max.x && pt.y > bounds.min.y && pt.y < bounds.max.y
+			&& pt.z > bounds.min.z && pt.z < bounds.max.z;
+	}
+
+	// true where the checker pattern replaces the material colour
+	bool checker(const vec3& pt) const
+	{
+		if (checker_scale == 0.0f)
+			return false;
+		float ax = fabs(normal.x), ay = fabs(normal.y), az = fabs(normal.z);
+		int u = 0, v = 2; // facing y: squares on x and z
+		if (ax >= ay && ax >= az) u = 1; // facing x: y and z
+		else if (az >= ay) v = 1; // facing z: x and y
+		return ((int)std::floor(pt[u] * checker_scale) + (int)std::floor(pt[v] * checker_scale)) & 1;
+	}
+};
+
+// Planes are usually unbounded and few, so they stay out of the BVHs and are tested one by one.
+struct PlaneSet : PrimitiveSet<PlaneSet>
+{
+	static constexpr bool bounded = false;
+
+	Buffer<Plane> items;
+
+	size_t size() const { return items.size(); }
+	bool empty() const { return items.empty(); }
+	void add(const Plane& plane) { items.push_back(plane); }
+	const Plane& operator[](uint32_t i) const { return items[i]; }
+	uint32_t materialId(uint32_t i) const { return items[i].material; }
+
+	template<typename S, typename F>
+	static void forEachArray(S& set, F&& visit) { visit(set.items); }
+
+	bool hit(uint32_t i, const Ray& ray, float& t) const
+	{
+		vec3 pt;
+		return items[i].hit(ray, t, pt);
+	}
+
+	void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3& diffuse_color) const
+	{
+		point = ray.orig + ray.dir * t;
+		N = items[i].normal;
+		if (items[i].checker(point)) diffuse_color = items[i].checker_color;
+	}
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Camera.h"
+#include "ImageOutput.h"
+#include "Renderer.h"
+#include "Scene.h"
+#include "SceneLoader.h"
+
+// Keeps a loaded scene and a one sample per pixel preview of it up to date while it is edited.
+// Every tile remembers what its rays were traced against (TileFootprint) and their bounces
+// (Wavefront::TileGeometry). An edit marks only the tiles that could change: their rays cross the
+// old or new box of a moved sphere, hit an edited material, or sampled the lights when one of them
+// changed. update() then traces just those tiles again, or for tiles only a light change touched,
+// only relights them; the preview comes out exactly as a full render of the edited scene would.
+class Preview
+{
+public:
+	// sphere_order is what prepare_scene returned, so that spheres are addressed in file order, also
+	// for a scene cache (which stores the order)
+	Preview(Scene& scene, const RenderSettings& settings, int width, int height, const std::vector<uint32_t>& sphere_order)
+		: scene(scene), settings(settings), camera(makeCamera(scene.view, width, height)), slot_of(sphere_order.size())
+	{
+		for (uint32_t slot = 0; slot < sphere_order.size(); ++slot)
+			slot_of[sphere_order[slot]] = slot;
+		this->settings.samples = 1;
+		this->settings.crop = Tile{ 0, 0, width, height };
+		int tile_size = std::max(1, settings.tile_size);
+		for (int y = 0; y < height; y += tile_size)
+			for (int x = 0; x < width; x += tile_size)
+				tiles.push_back({ x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) });
+		footprints.resize(tiles.size());
+		geometry.resize(tiles.size());
+		dirty.assign(tiles.size(), Retrace);
+		framebuffer.assign((size_t)width * height, vec3(0.0f));
+	}
+
+	int width() const { return camera.imageWidth(); }
+	int height() const { return camera.imageHeight(); }
+	size_t tileCount() const { return tiles.size(); }
+	const std::vector<vec3>& image() const { return framebuffer; }
+
+	bool moveSphere(uint32_t index, const vec3& center, float radius)
+	{
+		if (index >= scene.spheres.size() || !(radius > 0.0f))
+			return false;
+		uint32_t slot = slot_of.empty() ? index : slot_of[index];
+		AABB before = scene.spheres.bounds(slot);
+		scene.spheres.cx[slot] = center.x;
+		scene.spheres.cy[slot] = center.y;
+		scene.spheres.cz[slot] = center.z;
+		scene.spheres.radius[slot] = radius;
+		AABB after = scene.spheres.bounds(slot);
+		scene.refitAccelerationStructure();
+		mark(Retrace, [&](const TileFootprint& f) { return f.crosses(before) || f.crosses(after); });
+		return true;
+	}
+
+	size_t sphereCount() const { return scene.spheres.size(); }
+	float sphereRadius(uint32_t index) const { return scene.spheres.radius[slot_of.empty() ? index : slot_of[index]]; }
+
+	bool setMaterial(uint32_t index, const Material& material)
+	{
+		if (index >= scene.materials.size())
+			return false;
+		scene.materials[index] = material;
+		mark(Retrace, [&](const TileFootprint& f) { return f.usesMaterial(index); });
+		return true;
+	}
+
+	bool setLight(uint32_t index, const Light& light)
+	{
+		if (index >= scene.lights.size())
+			return false;
+		scene.lights[index] = light;
+		mark(Relight, [](const TileFootprint& f) { return f.lit; });
+		return true;
+	}
+
+	void setView(const View& view)
+	{
+		scene.view = view;
+		camera = makeCamera(view, width(), height());
+		dirty.assign(tiles.size(), Retrace);
+	}
+
+	// traces or relights the dirty tiles and returns how many there were
+	size_t update()
+	{
+		std::vector<uint32_t> work;
+		for (uint32_t t = 0; t < tiles.size(); ++t)
+			if (dirty[t] != Clean) work.push_back(t);
+		if (work.empty())
+			return 0;
+
+		TileScheduler scheduler(Tile{ 0, 0, 1, (int)work.size() }, 1, settings.threads);
+		std::vector<RayQueue> queues(scheduler.threadCount());
+		std::vector<std::vector<vec3>> buffers(scheduler.threadCount());
+		std::vector<Wavefront> integrators;
+		integrators.reserve(scheduler.threadCount());
+		for (unsigned w = 0; w < scheduler.threadCount(); ++w)
+			integrators.emplace_back(scene, settings);
+		scheduler.run([&](const Tile& job, unsigned worker) {
+			uint32_t t = work[job.y0];
+			const Tile& tile = tiles[t];
+			std::vector<vec3>& buffer = buffers[worker];
+			buffer.assign(tile.width() * tile.height(), vec3(0.0f));
+			footprints[t].clear();
+			integrators[worker].record(&footprints[t]);
+			if (dirty[t] == Relight) {
+				integrators[worker].relight(geometry[t], buffer.data());
+			}
+			else {
+				RayQueue& queue = queues[worker];
+				camera.generate(tile.x0, tile.y0, tile.x1, tile.y1, [&](int i, int j, const Ray& ray) {
+					queue.push(ray, 1.0f, (i - tile.x0) + (j - tile.y0) * tile.width(), sample_key(i, j, camera, 0));
+				});
+				integrators[worker].trace(queue, buffer.data(), &geometry[t]);
+			}
+			for (int j = tile.y0; j < tile.y1; ++j)
+				std::copy_n(&buffer[(j - tile.y0) * tile.width()], tile.width(), &framebuffer[tile.x0 + (size_t)j * width()]);
+		});
+		for (auto& integrator : integrators)
+			stats += integrator.stats();
+		dirty.assign(tiles.size(), Clean);
+		return work.size();
+	}
+
+	const RenderStats& totals() const { return stats; }
+
+private:
+	enum State : uint8_t { Clean, Relight, Retrace };
+
+	static Camera makeCamera(const View& view, int width, int height)
+	{
+		return Camera(view.position, view.look_at, view.up, view.fov, width, height);
+	}
+
+	template<typename F>
+	void mark(State state, F&& affected)
+	{
+		for (size_t t = 0; t < tiles.size(); ++t)
+			if (dirty[t] < state && affected(footprints[t]))
+				dirty[t] = state;
+	}
+
+	Scene& scene;
+	RenderSettings settings;
+	Camera camera;
+	std::vector<uint32_t> slot_of;
+	std::vector<Tile> tiles;
+	std::vector<TileFootprint> footprints;
+	std::vector<Wavefront::TileGeometry> geometry;
+	std::vector<uint8_t> dirty; // State of every tile
+	std::vector<vec3> framebuffer;
+	RenderStats stats;
+};
+
+// Reads edit commands from `in`, one per line, and answers every line with one line on stdout
+// ("ok ...", or "error: ..."). Spheres, lights and materials are numbered from 0 in the order the
+// scene file lists them, also when the scene is loaded from its cache.
+//
+//   sphere <index> <center x y z> [radius]
+//   light <index> <x y z> <intensity>
+//   material <index> <refractive index> <albedo a0 a1 a2 a3> <diffuse r g b> <specular exponent>
+//   camera <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>
+//   preview [path]   updates the tiles the edits since the last preview touched and writes it, in
+//                    the format of the path if one is given, else as the command line says
+//   render <path>    a full resolution render with the command line settings, through render_full
+//   quit
+//
+// Edits only mark tiles, so several of them can be batched before one preview.
+inline void serve_preview(Preview& preview, FILE* in, const std::string& preview_path, ImageFormat format, const ToneMapper& mapper,
+	const std::function<bool(const std::string&, std::string&)>& render_full)
+{
+	auto reply = [](const std::string& text) {
+		printf("%s\n", text.c_str());
+		fflush(stdout);
+	};
+	printf("ready: %dx%d preview, %zu tiles\n", preview.width(), preview.height(), preview.tileCount());
+	fflush(stdout);
+
+	std::string line;
+	for (int c = 0; c != EOF; ) {
+		line.clear();
+		while ((c = fgetc(in)) != EOF && c != '\n')
+			line.push_back((char)c);
+		TextCursor cursor{ line.data(), line.data() + line.size() };
+		std::string_view command;
+		if (cursor.done() || !cursor.word(command))
+			continue;
+
+		bool ok = true;
+		std::string usage;
+		uint32_t index;
+		if (command == "quit") {
+			reply("ok");
+			return;
+		}
+		else if (command == "sphere") {
+			vec3 center;
+			float radius = 0.0f;
+			usage = "sphere <index> <center x y z> [radius]";
+			ok = cursor.integer(index) && cursor.vector(center);
+			bool has_radius = ok && !cursor.done(); // otherwise it keeps its radius
+			ok = ok && (!has_radius || cursor.number(radius)) && cursor.done()
+				&& index < preview.sphereCount() && preview.moveSphere(index, center, has_radius ? radius : preview.sphereRadius(index));
+		}
+		else if (command == "light") {
+			vec3 position;
+			float intensity;
+			usage = "light <index> <x y z> <intensity>";
+			ok = cursor.integer(index) && cursor.vector(position) && cursor.number(intensity) && cursor.done()
+				&& preview.setLight(index, Light(position, intensity));
+		}
+		else if (command == "material") {
+			float refractive_index, specular_exponent;
+			vec4 albedo;
+			vec3 color;
+			usage = "material <index> <refractive index> <albedo a0 a1 a2 a3> <diffuse r g b> <specular exponent>";
+			ok = cursor.integer(index) && cursor.number(refractive_index) && cursor.number(albedo.x) && cursor.number(albedo.y)
+				&& cursor.number(albedo.z) && cursor.number(albedo.w) && cursor.vector(color) && cursor.number(specular_exponent) && cursor.done()
+				&& preview.setMaterial(index, Material(refractive_index, albedo, color, specular_exponent));
+		}
+		else if (command == "camera") {
+			View view;
+			float fov;
+			if (!cursor.vector(view.position) || !cursor.vector(view.look_at) || !cursor.vector(view.up) || !cursor.number(fov)
+				|| fov <= 0.0f || fov >= 180.0f || !cursor.done() || !view.valid()) {
+				reply("error: expected camera <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>, looking at a point "
+					"other than its position and not along its up vector");
+				continue;
+			}
+			view.fov = (float)(fov * PI / 180.0); // in double, rounded once like the (float)PI / 2 of View
+			preview.setView(view);
+		}
+		else if (command == "preview") {
+			std::string_view path;
+			bool has_path = !cursor.done() && cursor.word(path);
+			if (!cursor.done()) {
+				reply("error: expected preview [path]");
+				continue;
+			}
+			// a path given here picks its own format, like render does
+			std::string target = has_path ? std::string(path) : preview_path;
+			ImageFormat target_format = has_path ? image_format_for(target) : format;
+			Clock::time_point start = Clock::now();
+			size_t traced = preview.update();
+			double trace_ms = seconds_since(start) * 1000.0;
+			if (!write_image(target.c_str(), target_format, preview.width(), preview.height(), preview.image(), mapper)) {
+				reply("error: can not write " + target);
+				continue;
+			}
+			char text[256];
+			snprintf(text, sizeof(text), "ok %zu / %zu tiles updated in %.1f ms, %.1f ms with %s", traced, preview.tileCount(), trace_ms,
+				seconds_since(start) * 1000.0, target.c_str());
+			reply(text);
+			continue;
+		}
+		else if (command == "render") {
+			std::string_view path;
+			std::string error;
+			if (!cursor.word(path) || !cursor.done()) {
+				reply("error: expected render <path>");
+				continue;
+			}
+			Clock::time_point start = Clock::now();
+			if (!render_full(std::string(path), error)) {
+				reply("error: " + error);
+				continue;
+			}
+			char text[256];
+			snprintf(text, sizeof(text), "ok %.1f ms", seconds_since(start) * 1000.0);
+			reply(text);
+			continue;
+		}
+		else {
+			reply("error: unknown command '" + std::string(command) + "'");
+			continue;
+		}
+		reply(ok ? "ok" : "error: expected " + usage + " with an index in range");
+	}
+}
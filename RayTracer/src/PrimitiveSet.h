@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Ray.h"
+#include "Buffer.h"
+
+// What every primitive type of the scene provides. Each type is a structure of arrays holding only
+// primitives of that one shape:
+//
+//   size_t size() const;
+//   uint32_t materialId(uint32_t i) const;
+//   bool hit(uint32_t i, const Ray& ray, float& t) const;
+//   void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3& diffuse_color) const;
+//       the hit point and normal at distance t; may replace the material colour (e.g. a checker)
+//   template<typename S, typename F> static void forEachArray(S& set, F&& visit);
+//       calls visit(buffer) for every Buffer of the set, which is how the scene cache stores it
+//
+// and, unless it sets `bounded` to false and is tested one primitive at a time (the infinite planes):
+//
+//   AABB bounds(uint32_t i) const;
+//   void permute(const std::vector<uint32_t>& order); // slot i takes what was in slot order[i]
+//
+// Deriving from PrimitiveSet<Derived> adds the range queries the BVH leaves run, written in terms of
+// hit(). Calls are resolved at compile time: a type with a vector kernel defines its own versions
+// (SphereSet, TriangleSet), which hide these, and nothing goes through a virtual function.
+template<typename Derived>
+struct PrimitiveSet
+{
+	static constexpr bool bounded = true;
+
+	// Closest hit among slots [first, first + count). Shrinks tmax and sets nearest when a primitive
+	// closer than tmax is found; ties go to the lower slot.
+	void intersect(const Ray& ray, uint32_t first, uint32_t count, float& tmax, uint32_t& nearest) const
+	{
+		for (uint32_t i = first; i < first + count; ++i) {
+			float t;
+			if (self().hit(i, ray, t) && t < tmax) {
+				tmax = t;
+				nearest = i;
+			}
+		}
+	}
+
+	// any hit closer than tmax among slots [first, first + count)
+	bool occluded(const Ray& ray, uint32_t first, uint32_t count, float tmax) const
+	{
+		for (uint32_t i = first; i < first + count; ++i) {
+			float t;
+			if (self().hit(i, ray, t) && t < tmax)
+				return true;
+		}
+		return false;
+	}
+
+	// packet versions, one lane in `mask` at a time
+	void intersectPacket(const RayPacket& packet, uint32_t first, uint32_t count, uint32_t mask, float* tmax, uint32_t* nearest) const
+	{
+		for (int k = 0; mask; ++k, mask >>= 1)
+			if (mask & 1)
+				self().intersect(packet.ray(k), first, count, tmax[k], nearest[k]);
+	}
+
+	// returns the lanes in `mask` that hit something closer than their tmax
+	uint32_t occludedPacket(const RayPacket& packet, uint32_t first, uint32_t count, uint32_t mask, const float* tmax) const
+	{
+		uint32_t occluded = 0;
+		for (int k = 0; k < RayPacket::size; ++k)
+			if (mask >> k & 1 && self().occluded(packet.ray(k), first, count, tmax[k]))
+				occluded |= 1u << k;
+		return occluded;
+	}
+
+protected:
+	// for permute(): v[i] takes what was in v[order[i]]
+	template<typename T>
+	static void reorder(Buffer<T>& v, const std::vector<uint32_t>& order)
+	{
+		Buffer<T> tmp;
+		tmp.resize(v.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			tmp[i] = v[order[i]];
+		v.swap(tmp);
+	}
+
+private:
+	const Derived& self() const { return static_cast<const Derived&>(*this); }
+};
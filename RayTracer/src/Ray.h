@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Vector.h"
+
+struct Ray
+{
+	vec3 orig;
+	vec3 dir;
+
+	Ray() : orig(0.0f), dir(0.0f) {}
+	Ray(const vec3& o, const vec3& d) : orig(o), dir(d) {}
+
+	vec3 at(float t) const { return orig + t * dir; }
+};
+
+// A small bundle of coherent rays traced together; lanes not set in `active` are ignored.
+struct RayPacket
+{
+	static constexpr int size = 8;
+
+	float ox[size] = {}, oy[size] = {}, oz[size] = {};
+	float dx[size] = {}, dy[size] = {}, dz[size] = {};
+	uint32_t active = 0;
+
+	void set(int k, const Ray& ray)
+	{
+		ox[k] = ray.orig.x; oy[k] = ray.orig.y; oz[k] = ray.orig.z;
+		dx[k] = ray.dir.x; dy[k] = ray.dir.y; dz[k] = ray.dir.z;
+		active |= 1u << k;
+	}
+
+	Ray ray(int k) const { return Ray(vec3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k])); }
+};
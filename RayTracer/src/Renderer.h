@@ -0,0 +1,890 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Scene.h"
+#include "TileScheduler.h"
+
+struct RenderSettings
+{
+	int tile_size = 32;
+	unsigned threads = 0; // 0: one per hardware thread
+	bool packets = true;  // trace camera rays and their shadow rays in packets of RayPacket::size
+	float min_weight = 0.0f;     // secondary rays whose path weight is at or below this are not traced
+	float roulette_weight = 0.0f; // rays lighter than this survive with probability weight / roulette_weight, 0 disables
+	int samples = 1;              // antialiasing in render(): n * n (1, 4, 9, 16, ...), see render() and valid_sample_count()
+	float adaptive_threshold = 0.05f; // contrast above which a pixel gets more samples, 0: all pixels get all of them
+	Tile crop = { 0, 0, 0, 0 };   // pixels to render in image coordinates, empty: the whole image
+};
+
+// The antialiasing grid is n x n, so only perfect squares are sample counts
+inline bool valid_sample_count(int samples)
+{
+	if (samples < 1)
+		return false;
+	int n = (int)std::lround(std::sqrt((double)samples));
+	return n * n == samples;
+}
+
+struct RenderStats
+{
+	uint64_t primary_rays = 0;
+	uint64_t secondary_rays = 0;
+	uint64_t shadow_rays = 0;
+	uint64_t culled_rays = 0;     // secondary rays skipped for falling under min_weight
+	uint64_t terminated_rays = 0; // secondary rays ended by Russian roulette
+
+	// seconds spent per stage, summed over all worker threads
+	double generate_time = 0.0;  // camera ray generation
+	double intersect_time = 0.0; // closest-hit and shadow-ray queries
+	double shade_time = 0.0;     // lighting, environment lookups and spawning secondary rays
+
+	uint64_t rays() const { return primary_rays + secondary_rays + shadow_rays; }
+
+	RenderStats& operator+=(const RenderStats& o)
+	{
+		primary_rays += o.primary_rays;
+		secondary_rays += o.secondary_rays;
+		shadow_rays += o.shadow_rays;
+		culled_rays += o.culled_rays;
+		terminated_rays += o.terminated_rays;
+		generate_time += o.generate_time;
+		intersect_time += o.intersect_time;
+		shade_time += o.shade_time;
+		return *this;
+	}
+};
+
+using Clock = std::chrono::steady_clock;
+
+inline double seconds_since(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// integer hash (lowbias32), used to give every path its own reproducible random stream
+inline uint32_t hash32(uint32_t x)
+{
+	x ^= x >> 16; x *= 0x7feb352du;
+	x ^= x >> 15; x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// uniform float in [0, 1) from the top 24 bits of a hash
+inline float hash_float(uint32_t h)
+{
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Pending rays of one bounce in flat arrays, each with the pixel it contributes to, the
+// product of albedo weights along its path and a key identifying the path (seeds the roulette).
+struct RayQueue
+{
+	std::vector<float> ox, oy, oz, dx, dy, dz;
+	std::vector<float> weight;
+	std::vector<uint32_t> pixel;
+	std::vector<uint32_t> key;
+
+	size_t size() const { return pixel.size(); }
+	bool empty() const { return pixel.empty(); }
+
+	void clear()
+	{
+		ox.clear(); oy.clear(); oz.clear(); dx.clear(); dy.clear(); dz.clear();
+		weight.clear(); pixel.clear(); key.clear();
+	}
+
+	void push(const Ray& ray, float w, uint32_t p, uint32_t k)
+	{
+		ox.push_back(ray.orig.x); oy.push_back(ray.orig.y); oz.push_back(ray.orig.z);
+		dx.push_back(ray.dir.x); dy.push_back(ray.dir.y); dz.push_back(ray.dir.z);
+		weight.push_back(w);
+		pixel.push_back(p);
+		key.push_back(k);
+	}
+
+	Ray ray(size_t i) const { return Ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i])); }
+};
+
+// What the rays of one tile were traced against, so that after an edit of the scene it can be told
+// whether the tile may look different: every closest-hit query as a segment up to its hit (open
+// ended on a miss), every shadow ray up to its light, the materials of the surfaces hit and whether
+// any light was sampled. Filled by a Wavefront that is given one with record().
+struct TileFootprint
+{
+	std::vector<float> ox, oy, oz, dx, dy, dz, tmax;
+	std::vector<uint8_t> materials; // by material index, 1 where a ray hit a surface made of it
+	bool lit = false;
+
+	void clear()
+	{
+		ox.clear(); oy.clear(); oz.clear(); dx.clear(); dy.clear(); dz.clear(); tmax.clear();
+		materials.clear();
+		lit = false;
+	}
+
+	void add(const Ray& ray, float t)
+	{
+		ox.push_back(ray.orig.x); oy.push_back(ray.orig.y); oz.push_back(ray.orig.z);
+		dx.push_back(ray.dir.x); dy.push_back(ray.dir.y); dz.push_back(ray.dir.z);
+		tmax.push_back(t);
+	}
+
+	void addMaterial(uint32_t m)
+	{
+		if (m >= materials.size())
+			materials.resize(m + 1, 0);
+		materials[m] = 1;
+	}
+
+	bool usesMaterial(uint32_t m) const { return m < materials.size() && materials[m]; }
+
+	// whether any of the segments enters the box
+	bool crosses(const AABB& box) const
+	{
+		auto inverse = [](float d) { return std::fabs(d) > 1e-20f ? 1.0f / d : std::copysign(1e20f, d); };
+		for (size_t i = 0; i < tmax.size(); ++i) {
+			vec3 inv_dir(inverse(dx[i]), inverse(dy[i]), inverse(dz[i]));
+			if (box.intersect(vec3(ox[i], oy[i], oz[i]), inv_dir, tmax[i]) != std::numeric_limits<float>::infinity())
+				return true;
+		}
+		return false;
+	}
+};
+
+// Breadth-first replacement for the recursive castRay: all rays of one bounce go through the
+// intersection, shadow and shading stages together, and the reflected and refracted rays they
+// spawn form the next batch. Stack depth stays constant and every stage works on contiguous,
+// packet-sized groups of rays. One instance per worker thread, its buffers are reused across tiles.
+class Wavefront
+{
+public:
+	static constexpr int max_depth = 4; // rays deeper than this only see the environment
+
+	Wavefront(const Scene& scene, const RenderSettings& settings) : scene(scene), settings(settings) {}
+
+	const RenderStats& stats() const { return counters; }
+	RenderStats& stats() { return counters; }
+
+	struct Surface
+	{
+		vec3 point, N;
+		Material material;
+		uint32_t material_id;
+	};
+
+	// One bounce of a traced tile with everything that does not depend on the lights: the rays and
+	// their closest hits. Bounces past max_depth only hold the rays, which just see the environment.
+	struct Bounce
+	{
+		RayQueue rays;
+		std::vector<Surface> surfaces;
+		std::vector<uint8_t> hit;
+	};
+	using TileGeometry = std::vector<Bounce>;
+
+	// the rays traced from now on are added to footprint, none if it is null
+	void record(TileFootprint* footprint) { this->footprint = footprint; }
+
+	// Traces the camera rays in `queue` (consumed) and adds their radiance to out[pixel]. If geometry
+	// is given, it receives the bounces for relight().
+	void trace(RayQueue& queue, vec3* out, TileGeometry* geometry = nullptr)
+	{
+		std::swap(current, queue);
+		counters.primary_rays += current.size();
+		if (geometry)
+			geometry->clear();
+		for (int depth = 0; !current.empty(); ++depth) {
+			next.clear();
+			if (depth > max_depth) {
+				if (geometry)
+					geometry->push_back({ current, {}, {} });
+				escape(out);
+			}
+			else {
+				// only camera rays are coherent enough for packets, bounced rays fall back to single-ray queries
+				bool coherent = settings.packets && depth == 0;
+				Clock::time_point start = Clock::now();
+				intersect(coherent);
+				if (geometry)
+					geometry->push_back({ current, surfaces, hit });
+				occlude(coherent);
+				Clock::time_point shading = Clock::now();
+				illuminate();
+				shade(out, true);
+				Clock::time_point end = Clock::now();
+				counters.intersect_time += std::chrono::duration<double>(shading - start).count();
+				counters.shade_time += std::chrono::duration<double>(end - shading).count();
+			}
+			std::swap(current, next);
+		}
+		queue.clear();
+	}
+
+	// Shades the bounces trace() recorded again with the lights as they are now. Only the shadow rays
+	// are traced, the closest hits come from the record, and out[pixel] receives exactly what trace()
+	// would add as long as nothing but the lights changed. The bounces are swapped in to work on and
+	// handed back unchanged.
+	void relight(TileGeometry& geometry, vec3* out)
+	{
+		for (size_t depth = 0; depth < geometry.size(); ++depth) {
+			Bounce& bounce = geometry[depth];
+			std::swap(current, bounce.rays);
+			if ((int)depth > max_depth) {
+				escape(out);
+			}
+			else {
+				Clock::time_point start = Clock::now();
+				std::swap(surfaces, bounce.surfaces);
+				std::swap(hit, bounce.hit);
+				if (footprint)
+					recordHits();
+				occlude(settings.packets && depth == 0);
+				Clock::time_point shading = Clock::now();
+				illuminate();
+				shade(out, false);
+				std::swap(surfaces, bounce.surfaces);
+				std::swap(hit, bounce.hit);
+				Clock::time_point end = Clock::now();
+				counters.intersect_time += std::chrono::duration<double>(shading - start).count();
+				counters.shade_time += std::chrono::duration<double>(end - shading).count();
+			}
+			std::swap(current, bounce.rays);
+		}
+	}
+
+private:
+	// rays past max_depth only see the environment
+	void escape(vec3* out)
+	{
+		Clock::time_point start = Clock::now();
+		for (size_t r = 0; r < current.size(); ++r)
+			out[current.pixel[r]] = out[current.pixel[r]] + scene.environment.sample(vec3(current.dx[r], current.dy[r], current.dz[r])) * current.weight[r];
+		counters.shade_time += seconds_since(start);
+	}
+
+	// closest hit of every queued ray
+	void intersect(bool coherent)
+	{
+		size_t n = current.size();
+		surfaces.resize(n);
+		hit.assign(n, 0);
+		for (size_t base = 0; base < n; base += RayPacket::size) {
+			int lanes = (int)std::min<size_t>(RayPacket::size, n - base);
+			if (coherent) {
+				RayPacket packet;
+				for (int k = 0; k < lanes; ++k)
+					packet.set(k, current.ray(base + k));
+				PacketHit packet_hit;
+				uint32_t mask = scene_intersect_packet(packet, scene, packet_hit);
+				for (int k = 0; k < lanes; ++k) {
+					hit[base + k] = mask >> k & 1;
+					surfaces[base + k] = { packet_hit.point[k], packet_hit.N[k], packet_hit.material[k], packet_hit.material_id[k] };
+				}
+			}
+			else {
+				for (int k = 0; k < lanes; ++k) {
+					Surface& s = surfaces[base + k];
+					s.material = Material();
+					hit[base + k] = scene_intersect(current.ray(base + k), scene, s.point, s.N, s.material, &s.material_id);
+				}
+			}
+		}
+		if (footprint)
+			recordHits();
+	}
+
+	// adds the closest-hit queries of the current bounce to the footprint
+	void recordHits()
+	{
+		for (size_t r = 0; r < current.size(); ++r) {
+			Ray ray = current.ray(r);
+			float t = std::numeric_limits<float>::infinity();
+			if (hit[r]) {
+				t = dot(surfaces[r].point - ray.orig, ray.dir) / dot(ray.dir, ray.dir);
+				footprint->addMaterial(surfaces[r].material_id);
+			}
+			footprint->add(ray, t);
+		}
+	}
+
+	// shadow rays from every hit point to every light; records the direction to the light and
+	// whether it is visible, light by light, in the order illuminate() consumes them
+	void occlude(bool coherent)
+	{
+		lit.clear();
+		for (uint32_t r = 0; r < current.size(); ++r)
+			if (hit[r]) lit.push_back(r);
+
+		const std::vector<Light>& lights = scene.lights;
+		light_dirs.resize(lights.size() * lit.size());
+		visible.resize(lights.size() * lit.size());
+		for (uint32_t i = 0; i < lights.size(); ++i) {
+			for (size_t base = 0; base < lit.size(); base += RayPacket::size) {
+				int lanes = (int)std::min<size_t>(RayPacket::size, lit.size() - base);
+				vec3* light_dir = &light_dirs[i * lit.size() + base];
+				float light_distance[RayPacket::size] = {};
+				RayPacket shadow;
+				for (int k = 0; k < lanes; ++k) {
+					const Surface& s = surfaces[lit[base + k]];
+					light_dir[k] = (lights[i].position - s.point).normalized();
+					light_distance[k] = (lights[i].position - s.point).norm();
+					shadow.set(k, shadow_ray(s.point, s.N, light_dir[k]));
+				}
+
+				uint32_t occluded = 0;
+				if (coherent) {
+					occluded = scene_occluded_packet(shadow, scene, light_distance);
+				}
+				else {
+					for (int k = 0; k < lanes; ++k)
+						occluded |= (uint32_t)scene_occluded(shadow.ray(k), scene, light_distance[k]) << k;
+				}
+				counters.shadow_rays += lanes;
+				for (int k = 0; k < lanes; ++k)
+					visible[i * lit.size() + base + k] = !(occluded >> k & 1);
+				if (footprint) {
+					footprint->lit = true;
+					for (int k = 0; k < lanes; ++k)
+						footprint->add(shadow.ray(k), light_distance[k]);
+				}
+			}
+		}
+	}
+
+	// accumulates the intensities of the unblocked lights
+	void illuminate()
+	{
+		diffuse.assign(current.size(), 0.0f);
+		specular.assign(current.size(), 0.0f);
+
+		const std::vector<Light>& lights = scene.lights;
+		for (uint32_t i = 0; i < lights.size(); ++i) {
+			for (size_t l = 0; l < lit.size(); ++l) {
+				if (!visible[i * lit.size() + l])
+					continue;
+				uint32_t r = lit[l];
+				const Surface& s = surfaces[r];
+				const vec3& light_dir = light_dirs[i * lit.size() + l];
+				diffuse[r] += lights[i].intensity * std::max(0.0f, dot(light_dir, s.N));
+				specular[r] += lights[i].intensity * powf(std::max(0.0f, dot(reflect(light_dir, s.N), -vec3(current.dx[r], current.dy[r], current.dz[r]))), s.material.specular_exponent);
+			}
+		}
+	}
+
+	// adds the local contribution of every ray and, with continue_paths, queues its reflected and
+	// refracted continuations
+	void shade(vec3* out, bool continue_paths)
+	{
+		for (uint32_t r = 0; r < current.size(); ++r) {
+			Ray ray = current.ray(r);
+			float weight = current.weight[r];
+			uint32_t pixel = current.pixel[r];
+			if (!hit[r]) {
+				out[pixel] = out[pixel] + scene.environment.sample(ray.dir) * weight;
+				continue;
+			}
+
+			const vec3& point = surfaces[r].point;
+			const vec3& N = surfaces[r].N;
+			const Material& material = surfaces[r].material;
+			vec3 color = diffuse[r] * material.diffuse_color * material.albedo[0]
+				+ specular[r] * vec3(1.0f) * material.albedo[1];
+			out[pixel] = out[pixel] + color * weight;
+			if (!continue_paths)
+				continue;
+
+			vec3 reflect_dir = reflect(-ray.dir, N).normalized();
+			vec3 reflect_orig = dot(reflect_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f; // ޸һС
+			spawn(Ray(reflect_orig, reflect_dir), weight * material.albedo[2], pixel, current.key[r] * 2 + 0);
+
+			vec3 refract_dir = refract(ray.dir, N, material.refractive_index).normalized();
+			vec3 refract_orig = dot(refract_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f;
+			spawn(Ray(refract_orig, refract_dir), weight * material.albedo[3], pixel, current.key[r] * 2 + 1);
+		}
+	}
+
+	// Queues a secondary ray unless its contribution is too small to matter: rays at or below
+	// min_weight are dropped outright (zero-albedo lobes always are), and lighter rays than
+	// roulette_weight are kept with probability proportional to their weight and reweighted, which
+	// keeps the estimate unbiased.
+	void spawn(const Ray& ray, float weight, uint32_t pixel, uint32_t key)
+	{
+		if (weight <= settings.min_weight) {
+			counters.culled_rays++;
+			return;
+		}
+		if (weight < settings.roulette_weight) {
+			float survival = weight / settings.roulette_weight;
+			if (hash_float(hash32(key)) >= survival) {
+				counters.terminated_rays++;
+				return;
+			}
+			weight = settings.roulette_weight;
+		}
+		counters.secondary_rays++;
+		next.push(ray, weight, pixel, key);
+	}
+
+	const Scene& scene;
+	const RenderSettings& settings;
+	RenderStats counters;
+	TileFootprint* footprint = nullptr;
+
+	RayQueue current, next;
+	std::vector<Surface> surfaces;
+	std::vector<uint8_t> hit;
+	std::vector<uint32_t> lit; // queue indices of the rays that hit something
+	std::vector<vec3> light_dirs; // per light, per lit ray
+	std::vector<uint8_t> visible;
+	std::vector<float> diffuse, specular;
+};
+
+// The bounces of every tile of a one sample per pixel render(), kept so that after a change of the
+// lights relight() can shade them again while tracing nothing but shadow rays. Costs about 100
+// bytes per traced ray.
+struct GeometryCache
+{
+	Tile region = { 0, 0, 0, 0 };
+	int tile_size = 0;
+	int columns = 0;
+	std::vector<Wavefront::TileGeometry> tiles; // in TileScheduler order
+
+	bool empty() const { return tiles.empty(); }
+
+	void clear()
+	{
+		tiles.clear();
+		region = Tile{ 0, 0, 0, 0 };
+	}
+
+	void reset(const Tile& r, int size)
+	{
+		region = r;
+		tile_size = std::max(1, size);
+		columns = (r.width() + tile_size - 1) / tile_size;
+		tiles.assign((size_t)columns * ((r.height() + tile_size - 1) / tile_size), Wavefront::TileGeometry());
+	}
+
+	Wavefront::TileGeometry& at(const Tile& tile)
+	{
+		return tiles[(size_t)((tile.y0 - region.y0) / tile_size) * columns + (tile.x0 - region.x0) / tile_size];
+	}
+};
+
+// Traces the samples of every tile of `region` and calls deliver(tile, radiance) from the worker that
+// traced the tile, also for tiles that queued no rays. sample(tile, queue) queues the camera rays of the tile,
+// each with the index of the slot in `radiance` it contributes to and its path key. Once *stop is set the
+// remaining tiles are skipped. With a cache (reset to this region and tile size), every tile's bounces
+// are recorded into it.
+// Returns the summed counters of all workers.
+template<typename S, typename F>
+RenderStats trace_tiles(const Scene& scene, const Tile& region, const RenderSettings& settings, const std::atomic<bool>* stop, S&& sample, F&& deliver,
+	GeometryCache* cache = nullptr)
+{
+	TileScheduler scheduler(region, settings.tile_size, settings.threads);
+	std::vector<std::vector<vec3>> tile_buffers(scheduler.threadCount());
+	std::vector<RayQueue> queues(scheduler.threadCount());
+	std::vector<Wavefront> integrators;
+	integrators.reserve(scheduler.threadCount());
+	for (unsigned t = 0; t < scheduler.threadCount(); ++t)
+		integrators.emplace_back(scene, settings);
+	scheduler.run([&](const Tile& tile, unsigned worker) {
+		if (stop && stop->load(std::memory_order_relaxed))
+			return;
+		RayQueue& queue = queues[worker];
+		Clock::time_point start = Clock::now();
+		sample(tile, queue);
+		integrators[worker].stats().generate_time += seconds_since(start);
+		std::vector<vec3>& buffer = tile_buffers[worker];
+		buffer.assign(queue.size(), vec3(0.0f));
+		if (!queue.empty())
+			integrators[worker].trace(queue, buffer.data(), cache ? &cache->at(tile) : nullptr);
+		deliver(tile, buffer.data());
+	});
+
+	RenderStats stats;
+	for (auto& integrator : integrators)
+		stats += integrator.stats();
+	return stats;
+}
+
+// Path key of sample `index` of a pixel. Sample 0 is the one through the pixel centre; every
+// sample gets its own reproducible random stream.
+inline uint32_t sample_key(int i, int j, const Camera& camera, uint32_t index)
+{
+	uint32_t pixel_count = (uint32_t)camera.imageWidth() * camera.imageHeight();
+	return hash32(i + j * camera.imageWidth() + index * pixel_count);
+}
+
+// offset of the jittered sample in cell (a, b) of an n x n grid over the pixel
+inline vec2 stratified_offset(uint32_t key, int a, int b, int n)
+{
+	uint32_t h = hash32(key ^ 0x9e3779b9u);
+	return vec2((a + hash_float(h)) / n - 0.5f, (b + hash_float(hash32(h))) / n - 0.5f);
+}
+
+// largest per-channel relative difference, |a - b| / (a + b)
+inline float contrast(const vec3& a, const vec3& b)
+{
+	float c = 0.0f;
+	for (int k = 0; k < 3; ++k) {
+		float sum = a[k] + b[k];
+		if (sum > 0.0f)
+			c = std::max(c, std::fabs(a[k] - b[k]) / sum);
+	}
+	return c;
+}
+
+inline float luminance(const vec3& c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+// Reports rows of the region as they are finished. Tiles come back in any order; once the last tile
+// of a row of tiles is in, rows_done(y0, y1) is called from the worker that delivered it.
+class RowTracker
+{
+public:
+	RowTracker(const Tile& region, int tile_size, const std::function<void(int, int)>& rows_done)
+		: region(region), tile_size(std::max(1, tile_size)), rows_done(rows_done),
+		remaining((region.height() + this->tile_size - 1) / this->tile_size)
+	{
+		int per_row = (region.width() + this->tile_size - 1) / this->tile_size;
+		for (auto& r : remaining)
+			r = per_row;
+	}
+
+	void finished(const Tile& tile)
+	{
+		if (rows_done && remaining[(tile.y0 - region.y0) / tile_size].fetch_sub(1) == 1)
+			rows_done(tile.y0, tile.y1);
+	}
+
+private:
+	Tile region;
+	int tile_size;
+	const std::function<void(int, int)>& rows_done;
+	std::vector<std::atomic<int>> remaining;
+};
+
+// the part of the image settings.crop selects, clamped to the image; the whole image if it is empty
+inline Tile render_region(const Camera& camera, const RenderSettings& settings)
+{
+	const Tile& c = settings.crop;
+	if (c.width() <= 0 || c.height() <= 0)
+		return Tile{ 0, 0, camera.imageWidth(), camera.imageHeight() };
+	Tile region = { std::max(0, c.x0), std::max(0, c.y0), std::min(camera.imageWidth(), c.x1), std::min(camera.imageHeight(), c.y1) };
+	region.x1 = std::max(region.x0, region.x1);
+	region.y1 = std::max(region.y0, region.y1);
+	return region;
+}
+
+// Renders the pixels of render_region() into framebuffer (resized to the region, row by row) and
+// returns the summed counters of all workers. Every pixel comes out exactly as in a render of the
+// whole image, so strips or crops rendered separately can be pasted together.
+//
+// With settings.samples > 1 the image is antialiased adaptively. Every pixel first gets one sample
+// through its centre. Pixels that differ from a 4-neighbour by more than adaptive_threshold
+// (contrast(), relative per channel) are resampled on a jittered 2 x 2 grid, which replaces the
+// centre sample. Where those four samples still spread, their luminance standard deviation
+// above adaptive_threshold times their mean, the full n x n grid is added to them, so such a
+// pixel costs 4 + n * n samples (just the 4 for n = 2). Flat regions stay at one sample per
+// pixel; stats.primary_rays / pixels is the average spent.
+//
+// rows_done(y0, y1), if given, is called from the workers as rows of the framebuffer (in image
+// coordinates) are final, so that e.g. encoding can start before the whole image is done.
+//
+// cache, if given, receives the geometry of a one sample per pixel render for relight(). With more
+// samples it is left empty: which pixels get them depends on the lighting.
+inline RenderStats render(const Scene& scene, const Camera& camera, const RenderSettings& settings, std::vector<vec3>& framebuffer,
+	const std::function<void(int, int)>& rows_done = nullptr, GeometryCache* cache = nullptr)
+{
+	const Tile region = render_region(camera, settings);
+	const int width = region.width();
+	const int height = region.height();
+	auto index = [&](int i, int j) { return (i - region.x0) + (j - region.y0) * width; };
+
+	framebuffer.assign(width * height, vec3(0.0f));
+	RowTracker rows(region, settings.tile_size, rows_done);
+
+	int grid = std::max(1, (int)std::lround(std::sqrt((float)settings.samples)));
+	if (cache) {
+		cache->clear();
+		if (grid == 1)
+			cache->reset(region, settings.tile_size);
+	}
+	if (grid > 1 && settings.adaptive_threshold <= 0.0f) {
+		// uniform supersampling, every pixel gets the whole grid
+		return trace_tiles(scene, region, settings, nullptr, [&](const Tile& tile, RayQueue& queue) {
+			uint32_t slot = 0;
+			for (int j = tile.y0; j < tile.y1; ++j)
+				for (int i = tile.x0; i < tile.x1; ++i)
+					for (int s = 0; s < grid * grid; ++s, ++slot) {
+						uint32_t key = sample_key(i, j, camera, 1 + s);
+						queue.push(camera.ray(i, j, stratified_offset(key, s % grid, s / grid, grid)), 1.0f, slot, key);
+					}
+		}, [&](const Tile& tile, const vec3* radiance) {
+			for (int j = tile.y0; j < tile.y1; ++j)
+				for (int i = tile.x0; i < tile.x1; ++i, radiance += grid * grid) {
+					vec3 sum(0.0f);
+					for (int s = 0; s < grid * grid; ++s)
+						sum = sum + radiance[s];
+					framebuffer[index(i, j)] = sum * (1.0f / (grid * grid));
+				}
+			rows.finished(tile);
+		});
+	}
+
+	// The centre samples cover the region plus a one pixel border, so the contrast test sees the
+	// same neighbours as in a full render. Workers trace into a private tile buffer and copy whole
+	// rows out, so neighbouring tiles only share the cache lines on their borders and touch them
+	// once per row instead of once per pixel.
+	const Tile apron = grid == 1 ? region : Tile{ std::max(0, region.x0 - 1), std::max(0, region.y0 - 1),
+		std::min(camera.imageWidth(), region.x1 + 1), std::min(camera.imageHeight(), region.y1 + 1) };
+	std::vector<vec3> centre_buffer;
+	std::vector<vec3>& centre = grid == 1 ? framebuffer : centre_buffer;
+	centre.resize(apron.width() * apron.height());
+	RenderStats stats = trace_tiles(scene, apron, settings, nullptr, [&](const Tile& tile, RayQueue& queue) {
+		camera.generate(tile.x0, tile.y0, tile.x1, tile.y1, [&](int i, int j, const Ray& ray) {
+			queue.push(ray, 1.0f, (i - tile.x0) + (j - tile.y0) * tile.width(), sample_key(i, j, camera, 0));
+		});
+	}, [&](const Tile& tile, const vec3* radiance) {
+		for (int j = tile.y0; j < tile.y1; ++j)
+			std::copy_n(&radiance[(j - tile.y0) * tile.width()], tile.width(), &centre[(tile.x0 - apron.x0) + (j - apron.y0) * apron.width()]);
+		if (grid == 1)
+			rows.finished(tile);
+	}, grid == 1 ? cache : nullptr);
+	if (grid == 1)
+		return stats;
+
+	// level 1: 2 x 2 strata where the neighbourhood contrast is high
+	std::vector<uint8_t> refine(width * height, 0);
+	auto centre_at = [&](int i, int j) -> const vec3& { return centre[(i - apron.x0) + (j - apron.y0) * apron.width()]; };
+	for (int j = region.y0; j < region.y1; ++j) {
+		for (int i = region.x0; i < region.x1; ++i) {
+			const vec3& c = centre_at(i, j);
+			float most = 0.0f;
+			if (i > apron.x0) most = std::max(most, contrast(c, centre_at(i - 1, j)));
+			if (i + 1 < apron.x1) most = std::max(most, contrast(c, centre_at(i + 1, j)));
+			if (j > apron.y0) most = std::max(most, contrast(c, centre_at(i, j - 1)));
+			if (j + 1 < apron.y1) most = std::max(most, contrast(c, centre_at(i, j + 1)));
+			refine[index(i, j)] = most > settings.adaptive_threshold;
+			framebuffer[index(i, j)] = c;
+		}
+	}
+	std::vector<vec3>().swap(centre_buffer);
+
+	// the 2 x 2 sums are kept and averaged with the n x n samples added later; for even n every
+	// quadrant of the pixel then holds the same number of samples
+	std::vector<vec3> sum(width * height);
+	std::vector<uint8_t> spread(width * height, 0);
+	stats += trace_tiles(scene, region, settings, nullptr, [&](const Tile& tile, RayQueue& queue) {
+		uint32_t slot = 0;
+		for (int j = tile.y0; j < tile.y1; ++j)
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				if (!refine[index(i, j)])
+					continue;
+				for (int s = 0; s < 4; ++s, ++slot) {
+					uint32_t key = sample_key(i, j, camera, 1 + s);
+					queue.push(camera.ray(i, j, stratified_offset(key, s % 2, s / 2, 2)), 1.0f, slot, key);
+				}
+			}
+	}, [&](const Tile& tile, const vec3* radiance) {
+		for (int j = tile.y0; j < tile.y1; ++j)
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				int p = index(i, j);
+				if (!refine[p])
+					continue;
+				vec3 total(0.0f);
+				float l[4], mean = 0.0f;
+				for (int s = 0; s < 4; ++s) {
+					total = total + radiance[s];
+					l[s] = luminance(radiance[s]);
+					mean += l[s] * 0.25f;
+				}
+				float variance = 0.0f;
+				for (int s = 0; s < 4; ++s)
+					variance += (l[s] - mean) * (l[s] - mean) * (1.0f / 3.0f);
+				sum[p] = total;
+				framebuffer[p] = total * 0.25f;
+				spread[p] = std::sqrt(variance) > settings.adaptive_threshold * mean;
+				radiance += 4;
+			}
+		if (grid == 2)
+			rows.finished(tile);
+	});
+	if (grid == 2)
+		return stats;
+
+	// level 2: the whole n x n grid where the 2 x 2 samples disagree
+	stats += trace_tiles(scene, region, settings, nullptr, [&](const Tile& tile, RayQueue& queue) {
+		uint32_t slot = 0;
+		for (int j = tile.y0; j < tile.y1; ++j)
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				if (!spread[index(i, j)])
+					continue;
+				for (int s = 0; s < grid * grid; ++s, ++slot) {
+					uint32_t key = sample_key(i, j, camera, 5 + s);
+					queue.push(camera.ray(i, j, stratified_offset(key, s % grid, s / grid, grid)), 1.0f, slot, key);
+				}
+			}
+	}, [&](const Tile& tile, const vec3* radiance) {
+		for (int j = tile.y0; j < tile.y1; ++j)
+			for (int i = tile.x0; i < tile.x1; ++i) {
+				int p = index(i, j);
+				if (!spread[p])
+					continue;
+				vec3 total = sum[p];
+				for (int s = 0; s < grid * grid; ++s)
+					total = total + radiance[s];
+				framebuffer[p] = total * (1.0f / (4 + grid * grid));
+				radiance += grid * grid;
+			}
+		rows.finished(tile);
+	});
+	return stats;
+}
+
+// The image `cache` was recorded for, rendered again after only the lights changed: the same pixels
+// render() would give, but only the shadow rays are traced. The cache must come from a render() of
+// the same scene geometry, camera and settings.
+inline RenderStats relight(const Scene& scene, const RenderSettings& settings, GeometryCache& cache, std::vector<vec3>& framebuffer,
+	const std::function<void(int, int)>& rows_done = nullptr)
+{
+	const Tile region = cache.region;
+	framebuffer.assign(region.width() * region.height(), vec3(0.0f));
+	RowTracker rows(region, cache.tile_size, rows_done);
+	TileScheduler scheduler(region, cache.tile_size, settings.threads);
+	std::vector<std::vector<vec3>> tile_buffers(scheduler.threadCount());
+	std::vector<Wavefront> integrators;
+	integrators.reserve(scheduler.threadCount());
+	for (unsigned t = 0; t < scheduler.threadCount(); ++t)
+		integrators.emplace_back(scene, settings);
+	scheduler.run([&](const Tile& tile, unsigned worker) {
+		std::vector<vec3>& buffer = tile_buffers[worker];
+		buffer.assign(tile.width() * tile.height(), vec3(0.0f));
+		integrators[worker].relight(cache.at(tile), buffer.data());
+		for (int j = tile.y0; j < tile.y1; ++j)
+			std::copy_n(&buffer[(j - tile.y0) * tile.width()], tile.width(), &framebuffer[(tile.x0 - region.x0) + (j - region.y0) * region.width()]);
+		rows.finished(tile);
+	});
+
+	RenderStats stats;
+	for (auto& integrator : integrators)
+		stats += integrator.stats();
+	return stats;
+}
+
+struct ProgressiveSettings
+{
+	int passes = 16;             // samples per pixel to accumulate
+	double flush_interval = 2.0; // seconds between intermediate images, 0: none
+	double time_limit = 0.0;     // seconds, 0: none
+	const std::atomic<bool>* abort = nullptr; // set from another thread or a signal handler to stop early
+};
+
+// Progressive rendering of render_region(): one sample per pixel per pass, summed into a float
+// accumulation buffer.
+// Every flush_interval seconds the current average is copied into framebuffer and handed to
+// flush(framebuffer) on a separate thread, which may take its time (e.g. encode and write a
+// preview) while tracing continues. When the time limit passes or *abort is set, tiles already
+// being traced are finished and no new ones are started, so pixels can end up with one sample more
+// than others; each is averaged over its own count. framebuffer holds the final average on return.
+inline RenderStats render_progressive(const Scene& scene, const Camera& camera, const RenderSettings& settings, const ProgressiveSettings& progressive,
+	std::vector<vec3>& framebuffer, const std::function<void(const std::vector<vec3>&)>& flush)
+{
+	const Tile region = render_region(camera, settings);
+	const int width = region.width();
+	const int height = region.height();
+	Clock::time_point start = Clock::now();
+
+	std::vector<vec3> accumulated(width * height, vec3(0.0f));
+	std::vector<uint32_t> samples(width * height, 0);
+	std::mutex accumulation_mutex;
+
+	std::atomic<bool> stop(false);
+	auto stopping = [&]() {
+		return (progressive.abort && progressive.abort->load()) || (progressive.time_limit > 0.0 && seconds_since(start) >= progressive.time_limit);
+	};
+
+	auto resolve = [&](std::vector<vec3>& out) {
+		std::lock_guard<std::mutex> lock(accumulation_mutex);
+		out.resize(accumulated.size());
+		for (size_t p = 0; p < accumulated.size(); ++p)
+			out[p] = samples[p] ? accumulated[p] * (1.0f / samples[p]) : vec3(0.0f);
+	};
+
+	// the flusher sleeps between flushes, and also watches the stop conditions so that a pass is
+	// cut short as soon as they trigger rather than at its end
+	std::mutex flusher_mutex;
+	std::condition_variable wake;
+	bool finished = false;
+	std::thread flusher([&]() {
+		std::vector<vec3> preview;
+		Clock::time_point next_flush = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(progressive.flush_interval));
+		std::unique_lock<std::mutex> lock(flusher_mutex);
+		while (!finished) {
+			wake.wait_for(lock, std::chrono::milliseconds(50));
+			if (finished)
+				break;
+			if (stopping())
+				stop = true;
+			if (progressive.flush_interval > 0.0 && Clock::now() >= next_flush) {
+				lock.unlock();
+				resolve(preview);
+				flush(preview);
+				lock.lock();
+				next_flush = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(progressive.flush_interval));
+			}
+		}
+	});
+
+	RenderStats stats;
+	for (int pass = 0; pass < progressive.passes && !stop; ++pass) {
+		auto sample = [&](const Tile& tile, RayQueue& queue) {
+			// pass 0 goes through the pixel centres, later passes are jittered within the pixel
+			for (int j = tile.y0; j < tile.y1; ++j)
+				for (int i = tile.x0; i < tile.x1; ++i) {
+					uint32_t key = sample_key(i, j, camera, pass);
+					vec2 offset = pass == 0 ? vec2() : stratified_offset(key, 0, 0, 1);
+					queue.push(camera.ray(i, j, offset), 1.0f, (i - tile.x0) + (j - tile.y0) * tile.width(), key);
+				}
+		};
+		stats += trace_tiles(scene, region, settings, &stop, sample, [&](const Tile& tile, const vec3* buffer) {
+			std::lock_guard<std::mutex> lock(accumulation_mutex);
+			for (int j = tile.y0; j < tile.y1; ++j) {
+				const vec3* row = &buffer[(j - tile.y0) * tile.width()];
+				for (int i = tile.x0; i < tile.x1; ++i) {
+					int p = (i - region.x0) + (j - region.y0) * width;
+					accumulated[p] = accumulated[p] + row[i - tile.x0];
+					samples[p]++;
+				}
+			}
+		});
+		if (stopping())
+			stop = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(flusher_mutex);
+		finished = true;
+	}
+	wake.notify_one();
+	flusher.join();
+
+	resolve(framebuffer);
+	return stats;
+}
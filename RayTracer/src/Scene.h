@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "Vector.h"
+#include "Ray.h"
+#include "BVH.h"
+#include "EnvironmentMap.h"
+#include "BoxSet.h"
+#include "DiskSet.h"
+#include "PlaneSet.h"
+#include "SphereSet.h"
+#include "TriangleSet.h"
+
+#define PI 3.14159265358979323846
+
+struct Light
+{
+	Light(const vec3& p, float i) : position(p), intensity(i) {}
+	vec3 position;
+	float intensity;
+};
+
+struct Material
+{
+	Material(float r, const vec4& a, const vec3& color, float spec) : refractive_index(r), albedo(a), diffuse_color(color), specular_exponent(spec) {}
+	Material() : refractive_index(1.0f), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
+	float refractive_index;
+	vec4 albedo;
+	vec3 diffuse_color;
+	float specular_exponent;
+};
+
+// camera placement; the image size is chosen when the Camera is built
+struct View
+{
+	vec3 position = vec3(0.0f);
+	vec3 look_at = vec3(0.0f, 0.0f, -1.0f);
+	vec3 up = vec3(0.0f, 1.0f, 0.0f);
+	float fov = (float)PI / 2; // vertical, in radians
+
+	// a camera needs a direction to look in that is not along `up`, or it has no basis
+	bool valid() const
+	{
+		vec3 forward = look_at - position;
+		return forward.norm() > 0.0f && cross(forward, up).norm() > 1e-6f * forward.norm() * up.norm();
+	}
+};
+
+class MappedFile;
+
+enum class PrimitiveType : uint32_t
+{
+	Sphere,
+	Triangle,
+	Disk,
+	Box,
+	Plane,
+	None,
+};
+
+struct Scene
+{
+	std::vector<Material> materials;
+	SphereSet spheres;
+	PlaneSet planes;
+	std::vector<Light> lights;
+	View view;
+	std::string environment_path = "./envmap.jpg";
+	EnvironmentMap environment;
+	BVH bvh;
+	TriangleSet triangles; // every mesh of the scene, flattened
+	BVH mesh_bvh;          // over the triangles
+	DiskSet disks;
+	BVH disk_bvh;
+	BoxSet boxes;
+	BVH box_bvh;
+	std::shared_ptr<MappedFile> storage; // a scene cache the primitives and the BVHs point into, if loaded from one
+
+	uint32_t addMaterial(const Material& m)
+	{
+		materials.push_back(m);
+		return (uint32_t)materials.size() - 1;
+	}
+
+	// Calls visit(type, set, bvh) once for every primitive type, with the set as its own static type:
+	// the loops over this in scene_intersect() and the shadow queries are unrolled at compile time
+	// into direct calls of each type's kernels. bvh is null for types that are not bounded. A new
+	// shape needs a PrimitiveSet, a member and a line here; intersection, shading and the scene
+	// cache all pick it up from this list. Earlier types win ties; the few planes go first, as
+	// they are cheap to test and shorten the walks through the BVHs.
+	template<typename F> void forEachPrimitiveType(F&& visit) { forEach(*this, visit); }
+	template<typename F> void forEachPrimitiveType(F&& visit) const { forEach(*this, visit); }
+
+	bool hasAccelerationStructure() const
+	{
+		bool built = true;
+		forEachPrimitiveType([&](PrimitiveType, const auto& set, const BVH* bvh) {
+			built = built && (!bvh || !bvh->nodes.empty() || set.size() == 0);
+		});
+		return built;
+	}
+
+	// must be called again whenever primitives are added; returns the new sphere order, slot i now
+	// holds the sphere that was in slot order[i]
+	std::vector<uint32_t> buildAccelerationStructure()
+	{
+		std::vector<uint32_t> sphere_order;
+		forEachPrimitiveType([&](PrimitiveType type, auto& set, BVH* bvh) {
+			if constexpr (std::decay_t<decltype(set)>::bounded) {
+				std::vector<AABB> bounds(set.size());
+				for (uint32_t i = 0; i < set.size(); ++i)
+					bounds[i] = set.bounds(i);
+				bvh->build(bounds, 8);
+				// store the primitives in leaf order, so a leaf's range indexes the arrays directly
+				set.permute(bvh->indices);
+				if (type == PrimitiveType::Sphere)
+					sphere_order.swap(bvh->indices);
+				std::vector<uint32_t>().swap(bvh->indices);
+			}
+		});
+		return sphere_order;
+	}
+
+	// after spheres moved (but none were added), refits the boxes of the existing BVH
+	void refitAccelerationStructure()
+	{
+		bvh.refit([this](uint32_t i) { return spheres.bounds(i); });
+	}
+
+private:
+	template<typename S, typename F>
+	static void forEach(S& scene, F& visit)
+	{
+		using Tree = decltype(&scene.bvh);
+		visit(PrimitiveType::Plane, scene.planes, Tree(nullptr));
+		visit(PrimitiveType::Sphere, scene.spheres, &scene.bvh);
+		visit(PrimitiveType::Triangle, scene.triangles, &scene.mesh_bvh);
+		visit(PrimitiveType::Disk, scene.disks, &scene.disk_bvh);
+		visit(PrimitiveType::Box, scene.boxes, &scene.box_bvh);
+	}
+};
+
+// ر˵reflect䷽ɵָԴģrefract䷽ɹԴָ
+inline vec3 reflect(const vec3& L, const vec3& N)
+{
+	return 2 * dot(L, N) * N - L;
+}
+
+inline vec3 refract(const vec3& L, const vec3& N, float refractive_index)
+{
+	float cosi = -std::max(-1.0f, std::min(1.0f, dot(L, N)));
+	float etai = 1, etat = refractive_index;
+	vec3 n = N;
+	if (cosi < 0) {
+		cosi = -cosi;
+		std::swap(etai, etat);
+		n = -N;
+	}
+	float eta = etai / etat;
+	float k = 1 - eta * eta * (1 - cosi * cosi);
+	return k < 0 ? vec3(0.0f) : eta * L + (eta * cosi - sqrtf(k)) * n;
+}
+
+// the primitive a ray hits first
+struct SurfaceHit
+{
+	float t = std::numeric_limits<float>::max();
+	PrimitiveType type = PrimitiveType::None;
+	uint32_t index = UINT32_MAX;
+};
+
+// turns the nearest primitive found by the traversals into surface data; material_id, if given,
+// receives the index of the material in scene.materials
+inline bool scene_surface(const Ray& ray, const Scene& scene, const SurfaceHit& hit, vec3& hitPoint, vec3& N, Material& material,
+	uint32_t* material_id = nullptr)
+{
+	scene.forEachPrimitiveType([&](PrimitiveType type, const auto& set, const BVH*) {
+		if (type != hit.type)
+			return;
+		uint32_t id = set.materialId(hit.index);
+		material = scene.materials[id];
+		if (material_id) *material_id = id;
+		set.surface(hit.index, ray, hit.t, hitPoint, N, material.diffuse_color);
+	});
+	return hit.t < 1000.0f;
+}
+
+inline bool scene_intersect(const Ray& ray, const Scene& scene, vec3& hitPoint, vec3& N, Material& material, uint32_t* material_id = nullptr)
+{
+	SurfaceHit hit;
+	scene.forEachPrimitiveType([&](PrimitiveType type, const auto& set, const BVH* bvh) {
+		uint32_t nearest = UINT32_MAX;
+		if constexpr (std::decay_t<decltype(set)>::bounded) {
+			bvh->traverse(ray, hit.t, [&](uint32_t first, uint32_t count) {
+				set.intersect(ray, first, count, hit.t, nearest);
+				return false;
+			});
+		}
+		else {
+			set.intersect(ray, 0, (uint32_t)set.size(), hit.t, nearest);
+		}
+		if (nearest != UINT32_MAX) {
+			hit.type = type;
+			hit.index = nearest;
+		}
+	});
+	return scene_surface(ray, scene, hit, hitPoint, N, material, material_id);
+}
+
+struct PacketHit
+{
+	vec3 point[RayPacket::size];
+	vec3 N[RayPacket::size];
+	Material material[RayPacket::size];
+	uint32_t material_id[RayPacket::size];
+};
+
+// closest hit for every active lane, returns the lanes that hit something
+inline uint32_t scene_intersect_packet(const RayPacket& packet, const Scene& scene, PacketHit& hit)
+{
+	SurfaceHit nearest[RayPacket::size];
+	float tmax[RayPacket::size];
+	std::fill_n(tmax, RayPacket::size, std::numeric_limits<float>::max());
+	scene.forEachPrimitiveType([&](PrimitiveType type, const auto& set, const BVH* bvh) {
+		uint32_t slot[RayPacket::size];
+		std::fill_n(slot, RayPacket::size, UINT32_MAX);
+		if constexpr (std::decay_t<decltype(set)>::bounded) {
+			uint32_t active = packet.active;
+			bvh->traversePacket(packet, tmax, active, [&](uint32_t first, uint32_t count, uint32_t mask) {
+				set.intersectPacket(packet, first, count, mask, tmax, slot);
+			});
+		}
+		else {
+			set.intersectPacket(packet, 0, (uint32_t)set.size(), packet.active, tmax, slot);
+		}
+		for (int k = 0; k < RayPacket::size; ++k) {
+			if (slot[k] != UINT32_MAX) {
+				nearest[k].type = type;
+				nearest[k].index = slot[k];
+			}
+		}
+	});
+
+	uint32_t hits = 0;
+	for (int k = 0; k < RayPacket::size; ++k) {
+		if (!(packet.active >> k & 1))
+			continue;
+		nearest[k].t = tmax[k];
+		hit.material[k] = Material();
+		if (scene_surface(packet.ray(k), scene, nearest[k], hit.point[k], hit.N[k], hit.material[k], &hit.material_id[k]))
+			hits |= 1u << k;
+	}
+	return hits;
+}
+
+// any-hit query for shadow rays: true as soon as something blocks the ray before tmax
+inline bool scene_occluded(const Ray& ray, const Scene& scene, float tmax)
+{
+	tmax = std::min(tmax, 1000.0f); // scene_intersect ignores hits beyond this distance
+	bool occluded = false;
+	scene.forEachPrimitiveType([&](PrimitiveType, const auto& set, const BVH* bvh) {
+		if (occluded)
+			return;
+		if constexpr (std::decay_t<decltype(set)>::bounded) {
+			bvh->traverse(ray, tmax, [&](uint32_t first, uint32_t count) {
+				return occluded = set.occluded(ray, first, count, tmax);
+			});
+		}
+		else {
+			occluded = set.occluded(ray, 0, (uint32_t)set.size(), tmax);
+		}
+	});
+	return occluded;
+}
+
+// returns the active lanes that are blocked before their tmax
+inline uint32_t scene_occluded_packet(const RayPacket& packet, const Scene& scene, const float* light_distance)
+{
+	float tmax[RayPacket::size];
+	for (int k = 0; k < RayPacket::size; ++k)
+		tmax[k] = std::min(light_distance[k], 1000.0f); // scene_intersect ignores hits beyond this distance
+
+	uint32_t occluded = 0, pending = packet.active;
+	scene.forEachPrimitiveType([&](PrimitiveType, const auto& set, const BVH* bvh) {
+		if constexpr (std::decay_t<decltype(set)>::bounded) {
+			bvh->traversePacket(packet, tmax, pending, [&](uint32_t first, uint32_t count, uint32_t mask) {
+				uint32_t blocked = set.occludedPacket(packet, first, count, mask, tmax);
+				occluded |= blocked;
+				pending &= ~blocked;
+			});
+		}
+		else if (pending) {
+			uint32_t blocked = set.occludedPacket(packet, 0, (uint32_t)set.size(), pending, tmax);
+			occluded |= blocked;
+			pending &= ~blocked;
+		}
+	});
+	return occluded;
+}
+
+inline Ray shadow_ray(const vec3& point, const vec3& N, const vec3& light_dir)
+{
+	vec3 shadow_orig = dot(light_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f; // ֹӰཻ
+	return Ray(shadow_orig, light_dir);
+}
+
+// the four spheres, checkerboard and three lights of the reference image; the environment map is loaded separately
+inline void add_default_scene(Scene& scene)
+{
+	uint32_t ivory = scene.addMaterial(Material(1.0f, vec4(0.6f, 0.3f, 0.1f, 0.0f), vec3(0.4f, 0.4f, 0.3f), 50.0f));
+	uint32_t red = scene.addMaterial(Material(1.0f, vec4(0.9f, 0.1f, 0.0f, 0.0f), vec3(0.3f, 0.1f, 0.1f), 10.0f));
+	uint32_t mirror = scene.addMaterial(Material(1.0f, vec4(0.0f, 10.0f, 0.8f, 0.0f), vec3(1.0f), 1425.0f));
+	uint32_t glass = scene.addMaterial(Material(1.5f, vec4(0.0f, 0.5f, 0.1f, 0.8f), vec3(0.6f, 0.7f, 0.8f), 125.0f));
+
+	scene.spheres.add(vec3(-3, 0, -16), 2, ivory);
+	scene.spheres.add(vec3(-1.0, -1.5, -12), 2, glass);
+	scene.spheres.add(vec3(1.5, -0.5, -18), 3, red);
+	scene.spheres.add(vec3(7, 5, -18), 4, mirror);
+
+	Plane checkerboard(vec3(0, 1, 0), 4, scene.addMaterial(Material(1.0f, vec4(1, 0, 0, 0), vec3(1.0f) * 0.3f, 0.0f)));
+	checkerboard.bounds = AABB(vec3(-10, -std::numeric_limits<float>::infinity(), -30), vec3(10, std::numeric_limits<float>::infinity(), -10));
+	checkerboard.checker_scale = 0.5f;
+	checkerboard.checker_color = vec3(0.3f, 0.21f, 0.09f);
+	scene.planes.add(checkerboard);
+
+	scene.lights.emplace_back(vec3(-20, 20, 20), 1.5f);
+	scene.lights.emplace_back(vec3(30, 50, -25), 1.8f);
+	scene.lights.emplace_back(vec3(30, 20, 30), 1.7f);
+}
+
+// The default lights and materials with `count` randomly placed spheres instead of the four fixed
+// ones, filling the view frustum between z = -10 and z = -40. Radii shrink with the cube root of
+// the count, so the spheres fill about the same fraction of that volume at any count.
+inline void add_random_spheres(Scene& scene, uint32_t count, uint32_t seed = 1)
+{
+	add_default_scene(scene);
+	scene.spheres = SphereSet();
+	scene.spheres.reserve(count);
+	uint32_t sphere_materials = 4; // the checkerboard's material comes last
+
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	float size = 2.0f / std::cbrt(std::max(1.0f, count / 4.0f));
+	for (uint32_t i = 0; i < count; ++i) {
+		float z = -10.0f - 30.0f * unit(rng);
+		float x = (unit(rng) * 2.0f - 1.0f) * -z * 16.0f / 9.0f;
+		float y = (unit(rng) * 2.0f - 1.0f) * -z;
+		float r = size * (0.5f + unit(rng));
+		scene.spheres.add(vec3(x, y, z), r, rng() % sphere_materials);
+	}
+}
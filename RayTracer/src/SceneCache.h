@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Scene.h"
+#include "SceneLoader.h"
+
+// Binary scene cache. A header, a table of sections and the 64-byte aligned sections themselves:
+// the material and light tables, the order the BVH build put the spheres in (so they can still be
+// addressed in file order), then for every primitive type (in Scene::forEachPrimitiveType order)
+// each of its arrays (in the set's forEachArray order) in BVH leaf order, followed by its BVH nodes
+// if it has a BVH. Everything is in the in-memory layout of this build. Loading maps the file and
+// points the primitive arrays and the BVHs straight into it, so nothing is parsed or built and
+// pages are only read when the renderer first touches them. The header records the byte order and
+// the table the element size of every section; a cache written by a build with different types or
+// layouts is rejected rather than misread. Section contents other than the sphere order are trusted.
+struct SceneCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t material_size, light_size;
+	uint32_t material_count, light_count, environment_path_length, section_count;
+	uint32_t sphere_order_count, reserved;
+	View view;
+	uint64_t materials, lights, environment_path, sphere_order; // section offsets
+	uint64_t file_size;
+};
+
+// one entry of the table that follows the header
+struct SceneCacheSection
+{
+	uint64_t offset;
+	uint64_t count;
+	uint32_t element_size;
+	uint32_t reserved;
+};
+
+static_assert(std::is_trivially_copyable<Material>::value && std::is_trivially_copyable<Light>::value
+	&& std::is_trivially_copyable<BVHNode>::value && std::is_trivially_copyable<View>::value, "scene cache sections are raw copies of these");
+
+constexpr char scene_cache_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr uint32_t scene_cache_version = 4;
+constexpr uint32_t scene_cache_byte_order = 0x01020304;
+constexpr uint64_t scene_cache_alignment = 64;
+
+inline bool is_scene_cache(const char* path)
+{
+	char magic[sizeof(scene_cache_magic)] = {};
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return false;
+	size_t read = fread(magic, 1, sizeof(magic), file);
+	fclose(file);
+	return read == sizeof(magic) && memcmp(magic, scene_cache_magic, sizeof(magic)) == 0;
+}
+
+// the scene must have its acceleration structure built, which also puts the primitives in leaf order;
+// sphere_order is what buildAccelerationStructure returned, so that loading can give it back
+inline bool save_scene_cache(const Scene& scene, const std::vector<uint32_t>& sphere_order, const char* path, std::string& error)
+{
+	if (!scene.hasAccelerationStructure()) {
+		error = "the acceleration structure has not been built";
+		return false;
+	}
+	if (sphere_order.size() != scene.spheres.size()) {
+		error = "the sphere order does not match the scene";
+		return false;
+	}
+
+	struct Section { uint64_t* offset; const void* data; uint64_t bytes; };
+	std::vector<Section> sections;
+	std::vector<SceneCacheSection> table;
+	auto add = [&](const auto& buffer) {
+		using T = typename std::decay_t<decltype(buffer)>::value_type;
+		static_assert(std::is_trivially_copyable<T>::value, "scene cache sections are raw copies");
+		table.push_back({ 0, buffer.size(), (uint32_t)sizeof(T), 0 });
+		sections.push_back({ nullptr, buffer.data(), sizeof(T) * buffer.size() });
+	};
+	scene.forEachPrimitiveType([&](PrimitiveType, const auto& set, const BVH* bvh) {
+		std::decay_t<decltype(set)>::forEachArray(set, add);
+		if (bvh)
+			add(bvh->nodes);
+	});
+	for (size_t i = 0; i < table.size(); ++i)
+		sections[i].offset = &table[i].offset;
+
+	SceneCacheHeader header = {};
+	memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+	header.version = scene_cache_version;
+	header.byte_order = scene_cache_byte_order;
+	header.material_size = sizeof(Material);
+	header.light_size = sizeof(Light);
+	header.material_count = (uint32_t)scene.materials.size();
+	header.light_count = (uint32_t)scene.lights.size();
+	header.environment_path_length = (uint32_t)scene.environment_path.size();
+	header.section_count = (uint32_t)table.size();
+	header.sphere_order_count = (uint32_t)sphere_order.size();
+	header.view = scene.view;
+	sections.push_back({ &header.materials, scene.materials.data(), sizeof(Material) * scene.materials.size() });
+	sections.push_back({ &header.lights, scene.lights.data(), sizeof(Light) * scene.lights.size() });
+	sections.push_back({ &header.environment_path, scene.environment_path.data(), scene.environment_path.size() });
+	sections.push_back({ &header.sphere_order, sphere_order.data(), sizeof(uint32_t) * sphere_order.size() });
+
+	auto align = [](uint64_t x) { return (x + scene_cache_alignment - 1) / scene_cache_alignment * scene_cache_alignment; };
+	const uint64_t table_bytes = sizeof(SceneCacheSection) * table.size();
+	uint64_t offset = align(sizeof(SceneCacheHeader) + table_bytes);
+	for (const Section& s : sections) {
+		*s.offset = offset;
+		offset = align(offset + s.bytes);
+	}
+	header.file_size = offset;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		error = std::string("can not create ") + path;
+		return false;
+	}
+	static const char zeros[scene_cache_alignment] = {};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = ok && (table.empty() || fwrite(table.data(), sizeof(SceneCacheSection), table.size(), file) == table.size());
+	uint64_t written = sizeof(header) + table_bytes;
+	// the sections were laid out in this order, so the file is written front to back
+	for (const Section& s : sections) {
+		ok = ok && fwrite(zeros, 1, *s.offset - written, file) == *s.offset - written;
+		ok = ok && (s.bytes == 0 || fwrite(s.data, 1, s.bytes, file) == s.bytes);
+		written = *s.offset + s.bytes;
+	}
+	ok = ok && fwrite(zeros, 1, header.file_size - written, file) == header.file_size - written;
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+		error = std::string("can not write ") + path;
+	return ok;
+}
+
+// replaces the contents of the scene with the cache; its BVHs are ready, do not rebuild them.
+// sphere_order, if given, receives the order of the spheres as buildAccelerationStructure returned it.
+inline bool load_scene_cache(const char* path, Scene& scene, std::string& error, std::vector<uint32_t>* sphere_order = nullptr)
+{
+	auto file = std::make_shared<MappedFile>();
+	if (!file->open(path)) {
+		error = std::string("can not map ") + path;
+		return false;
+	}
+
+	SceneCacheHeader header;
+	if (file->size() < sizeof(header)) {
+		error = std::string(path) + " is not a scene cache";
+		return false;
+	}
+	memcpy(&header, file->data(), sizeof(header));
+	if (memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0) {
+		error = std::string(path) + " is not a scene cache";
+		return false;
+	}
+	if (header.version != scene_cache_version || header.byte_order != scene_cache_byte_order
+		|| header.material_size != sizeof(Material) || header.light_size != sizeof(Light)) {
+		error = std::string(path) + " was written by an incompatible build, convert the scene again";
+		return false;
+	}
+	if (header.file_size != file->size() || (file->size() - sizeof(header)) / sizeof(SceneCacheSection) < header.section_count) {
+		error = std::string(path) + " is truncated or corrupt";
+		return false;
+	}
+	std::vector<SceneCacheSection> table(header.section_count);
+	if (!table.empty())
+		memcpy(table.data(), file->data() + sizeof(header), sizeof(SceneCacheSection) * table.size());
+
+	auto section = [&](uint64_t offset, uint64_t bytes) -> uint8_t* {
+		if (offset % scene_cache_alignment != 0 || offset > file->size() || bytes > file->size() - offset)
+			return nullptr;
+		return file->data() + offset;
+	};
+	uint8_t* materials = section(header.materials, sizeof(Material) * (uint64_t)header.material_count);
+	uint8_t* lights = section(header.lights, sizeof(Light) * (uint64_t)header.light_count);
+	uint8_t* environment_path = section(header.environment_path, header.environment_path_length);
+	uint8_t* order = section(header.sphere_order, sizeof(uint32_t) * (uint64_t)header.sphere_order_count);
+	if (!materials || !lights || !environment_path || !order) {
+		error = std::string(path) + " is truncated or corrupt";
+		return false;
+	}
+
+	// the primitive arrays and the BVHs stay in the mapping
+	size_t next = 0;
+	bool compatible = true, intact = true;
+	auto view = [&](auto& buffer) {
+		using T = typename std::decay_t<decltype(buffer)>::value_type;
+		if (next == table.size() || table[next].element_size != sizeof(T)) {
+			compatible = false;
+			return;
+		}
+		const SceneCacheSection& s = table[next++];
+		uint8_t* data = s.count <= file->size() / sizeof(T) ? section(s.offset, sizeof(T) * s.count) : nullptr;
+		if (!data) {
+			intact = false;
+			return;
+		}
+		buffer.view((T*)data, s.count);
+	};
+	scene.forEachPrimitiveType([&](PrimitiveType, auto& set, BVH* bvh) {
+		using Set = std::decay_t<decltype(set)>;
+		set = Set();
+		Set::forEachArray(set, view);
+		if (bvh) {
+			view(bvh->nodes);
+			std::vector<uint32_t>().swap(bvh->indices);
+			intact = intact && (set.size() == 0 || !bvh->nodes.empty());
+		}
+	});
+	// the order is used to index the spheres, so unlike the rest it is checked
+	const uint32_t* order_begin = (const uint32_t*)order;
+	intact = intact && header.sphere_order_count == scene.spheres.size()
+		&& std::all_of(order_begin, order_begin + header.sphere_order_count, [&](uint32_t i) { return i < header.sphere_order_count; });
+	if (!compatible || next != table.size() || !intact) {
+		// nothing may keep pointing into the mapping
+		scene.forEachPrimitiveType([](PrimitiveType, auto& set, BVH* bvh) {
+			set = std::decay_t<decltype(set)>();
+			if (bvh) *bvh = BVH();
+		});
+		error = std::string(path) + (intact ? " was written by an incompatible build, convert the scene again" : " is truncated or corrupt");
+		return false;
+	}
+
+	// the small tables are copied
+	scene.materials.assign((const Material*)materials, (const Material*)materials + header.material_count);
+	scene.lights.assign((const Light*)lights, (const Light*)lights + header.light_count);
+	scene.view = header.view;
+	scene.environment_path.assign((const char*)environment_path, header.environment_path_length);
+	if (sphere_order)
+		sphere_order->assign(order_begin, order_begin + header.sphere_order_count);
+	scene.storage = file;
+	return true;
+}
+
+// loads a scene cache or a text scene file, whichever `path` is; sphere_order as for load_scene_cache,
+// untouched for a text file, whose spheres are still in file order
+inline bool load_scene(const char* path, Scene& scene, std::string& error, std::vector<uint32_t>* sphere_order = nullptr)
+{
+	if (is_scene_cache(path))
+		return load_scene_cache(path, scene, error, sphere_order);
+	SceneLoader loader(scene);
+	if (!loader.load(path)) {
+		error = loader.error();
+		return false;
+	}
+	return true;
+}
+
+// Everything a render needs before it can start: the scene at `path` (the built-in scene if it is
+// empty), its environment map (through the cache in environment_cache, if not empty) and the BVH,
+// unless the scene came with one. sphere_order, if given, receives the order the BVH build put the
+// spheres in (see buildAccelerationStructure), which a scene cache stores along with its BVH.
+inline bool prepare_scene(const std::string& path, Scene& scene, std::string& error, const std::string& environment_cache = std::string(),
+	std::vector<uint32_t>* sphere_order = nullptr)
+{
+	if (!path.empty()) {
+		if (!load_scene(path.c_str(), scene, error, sphere_order))
+			return false;
+	}
+	else {
+		add_default_scene(scene);
+	}
+	if (!scene.environment.load(scene.environment_path.c_str(), environment_cache)) {
+		error = "can not load the environment map!";
+		return false;
+	}
+	if (!scene.hasAccelerationStructure()) {
+		std::vector<uint32_t> order = scene.buildAccelerationStructure();
+		if (sphere_order)
+			sphere_order->swap(order);
+	}
+	return true;
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ObjLoader.h"
+#include "Scene.h"
+#include "TextCursor.h"
+
+// Loads the line-oriented text scene format:
+//
+//   # comments run to the end of the line
+//   material <name> <refractive index> <albedo a0 a1 a2 a3> <diffuse r g b> <specular exponent>
+//   sphere <x y z> <radius> <material>
+//   plane <normal x y z> <offset> <material> [bounds <min x y z> <max x y z>] [checker <scale> <r g b>]
+//   disk <center x y z> <normal x y z> <radius> <material>
+//   box <min x y z> <max x y z> <material>     (opposite corners, in any order)
+//   light <x y z> <intensity>
+//   camera <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>
+//   envmap <path relative to the scene file>
+//   mesh <OBJ file relative to the scene file> <material> [scale <s>] [translate <x y z>]
+//
+// Materials must be defined before they are used. The file is read in fixed-size chunks and parsed
+// in place, one line at a time, straight into the scene's arrays. A first pass only counts the
+// sphere lines, so the sphere arrays are allocated once at their final size and peak memory stays
+// at the size of the loaded scene plus one chunk.
+class SceneLoader
+{
+public:
+	explicit SceneLoader(Scene& scene) : scene(scene) {}
+
+	// adds the contents of the file to the scene; on failure error() says where and why
+	bool load(const char* path)
+	{
+		FILE* file = fopen(path, "rb");
+		if (!file)
+			return fail(std::string("can not open ") + path);
+
+		std::string_view p(path);
+		size_t slash = p.find_last_of("/\\");
+		directory = slash == std::string_view::npos ? std::string() : std::string(p.substr(0, slash + 1));
+		file_name = path;
+
+		size_t sphere_count = 0;
+		bool ok = for_each_line(file, [&](const char* begin, const char* end) {
+			TextCursor c{ begin, end };
+			std::string_view keyword;
+			if (c.word(keyword) && keyword == "sphere")
+				sphere_count++;
+			return true;
+		});
+		if (ok) {
+			scene.spheres.reserve(scene.spheres.size() + sphere_count);
+			rewind(file);
+			line_number = 0;
+			ok = for_each_line(file, [&](const char* begin, const char* end) {
+				line_number++;
+				return parse_line(begin, end);
+			});
+		}
+		fclose(file);
+		return ok;
+	}
+
+	const std::string& error() const { return message; }
+
+private:
+	static constexpr size_t chunk_size = 1 << 20;
+
+	// Calls visit(begin, end) for every line of the file, without the line break. Lines are parsed
+	// out of a reusable buffer; only a line longer than the buffer makes it grow.
+	template<typename F>
+	bool for_each_line(FILE* file, F&& visit)
+	{
+		buffer.resize(chunk_size);
+		size_t filled = 0;
+		for (;;) {
+			if (filled == buffer.size())
+				buffer.resize(buffer.size() * 2);
+			size_t read = fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+			if (read == 0 && ferror(file))
+				return fail("read error");
+			filled += read;
+			bool eof = read == 0;
+
+			const char* line = buffer.data();
+			const char* end = buffer.data() + filled;
+			for (;;) {
+				const char* newline = (const char*)memchr(line, '\n', end - line);
+				if (!newline)
+					break;
+				if (!visit(line, newline))
+					return false;
+				line = newline + 1;
+			}
+			if (eof)
+				return line == end || visit(line, end);
+			filled = end - line;
+			memmove(buffer.data(), line, filled);
+		}
+	}
+
+	bool parse_line(const char* begin, const char* end)
+	{
+		TextCursor c{ begin, end };
+		std::string_view keyword;
+		if (c.done() || !c.word(keyword))
+			return true;
+
+		if (keyword == "sphere") {
+			vec3 center;
+			float radius;
+			uint32_t m;
+			if (!c.vector(center) || !c.number(radius) || !(radius > 0.0f))
+				return syntax("sphere <x y z> <radius> <material> with a positive radius");
+			if (!material(c, m))
+				return false;
+			scene.spheres.add(center, radius, m);
+		}
+		else if (keyword == "material") {
+			std::string_view name;
+			float refractive_index, specular_exponent;
+			vec4 albedo;
+			vec3 color;
+			if (!c.word(name) || !c.number(refractive_index) || !c.number(albedo.x) || !c.number(albedo.y) || !c.number(albedo.z)
+				|| !c.number(albedo.w) || !c.vector(color) || !c.number(specular_exponent))
+				return syntax("material <name> <refractive index> <albedo a0 a1 a2 a3> <diffuse r g b> <specular exponent>");
+			materials[std::string(name)] = scene.addMaterial(Material(refractive_index, albedo, color, specular_exponent));
+			last_name.clear();
+		}
+		else if (keyword == "plane") {
+			vec3 normal;
+			float offset;
+			uint32_t m;
+			if (!c.vector(normal) || !c.number(offset) || normal.norm() == 0.0f)
+				return syntax("plane <normal x y z> <offset> <material> [bounds <min x y z> <max x y z>] [checker <scale> <r g b>]");
+			if (!material(c, m))
+				return false;
+			Plane plane(normal, offset, m);
+			std::string_view option;
+			while (!c.done() && c.word(option)) {
+				if (option == "bounds" && c.vector(plane.bounds.min) && c.vector(plane.bounds.max))
+					continue;
+				if (option == "checker" && c.number(plane.checker_scale) && c.vector(plane.checker_color))
+					continue;
+				return syntax("plane options are bounds <min x y z> <max x y z> and checker <scale> <r g b>");
+			}
+			scene.planes.add(plane);
+		}
+		else if (keyword == "disk") {
+			vec3 center, normal;
+			float radius;
+			uint32_t m;
+			if (!c.vector(center) || !c.vector(normal) || !c.number(radius) || normal.norm() == 0.0f || !(radius > 0.0f))
+				return syntax("disk <center x y z> <normal x y z> <radius> <material>");
+			if (!material(c, m))
+				return false;
+			scene.disks.add(center, normal, radius, m);
+		}
+		else if (keyword == "box") {
+			vec3 min, max;
+			uint32_t m;
+			if (!c.vector(min) || !c.vector(max))
+				return syntax("box <min x y z> <max x y z> <material>");
+			if (!material(c, m))
+				return false;
+			scene.boxes.add(min, max, m);
+		}
+		else if (keyword == "light") {
+			vec3 position;
+			float intensity;
+			if (!c.vector(position) || !c.number(intensity))
+				return syntax("light <x y z> <intensity>");
+			scene.lights.emplace_back(position, intensity);
+		}
+		else if (keyword == "camera") {
+			View view;
+			float fov;
+			if (!c.vector(view.position) || !c.vector(view.look_at) || !c.vector(view.up) || !c.number(fov) || fov <= 0.0f || fov >= 180.0f)
+				return syntax("camera <position x y z> <look at x y z> <up x y z> <vertical fov in degrees>");
+			if (!view.valid())
+				return fail_line("the camera must look at a point other than its position, not along its up vector");
+			view.fov = (float)(fov * PI / 180.0); // in double, rounded once like the (float)PI / 2 of View
+			scene.view = view;
+		}
+		else if (keyword == "envmap") {
+			std::string_view path;
+			if (!c.word(path))
+				return syntax("envmap <path>");
+			scene.environment_path = resolve(path);
+		}
+		else if (keyword == "mesh") {
+			std::string_view path;
+			uint32_t m;
+			float scale = 1.0f;
+			vec3 offset(0.0f);
+			if (!c.word(path))
+				return syntax("mesh <path> <material> [scale <s>] [translate <x y z>]");
+			if (!material(c, m))
+				return false;
+			std::string_view option;
+			while (!c.done() && c.word(option)) {
+				if (option == "scale" && c.number(scale) && scale > 0.0f)
+					continue;
+				if (option == "translate" && c.vector(offset))
+					continue;
+				return syntax("mesh options are scale <s> (positive) and translate <x y z>");
+			}
+			ObjLoader obj;
+			if (!obj.load(resolve(path).c_str(), scene.triangles, m, scale, offset))
+				return fail_line(obj.error());
+		}
+		else {
+			return fail_line("unknown keyword '" + std::string(keyword) + "'");
+		}
+
+		if (!c.done())
+			return fail_line("unexpected text after " + std::string(keyword));
+		return true;
+	}
+
+	std::string resolve(std::string_view path) const
+	{
+		bool absolute = path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':');
+		return absolute ? std::string(path) : directory + std::string(path);
+	}
+
+	// material names are looked up once per sphere line, consecutive spheres usually share one
+	bool material(TextCursor& c, uint32_t& m)
+	{
+		std::string_view name;
+		if (!c.word(name))
+			return fail_line("missing material name");
+		if (name != last_name) {
+			auto it = materials.find(std::string(name));
+			if (it == materials.end())
+				return fail_line("unknown material '" + std::string(name) + "'");
+			last_name = name;
+			last_material = it->second;
+		}
+		m = last_material;
+		return true;
+	}
+
+	bool syntax(const char* usage) { return fail_line(std::string("expected ") + usage); }
+	bool fail_line(const std::string& what) { return fail(file_name + ":" + std::to_string(line_number) + ": " + what); }
+	bool fail(const std::string& what)
+	{
+		message = what;
+		return false;
+	}
+
+	Scene& scene;
+	std::unordered_map<std::string, uint32_t> materials;
+	std::string last_name;
+	uint32_t last_material = 0;
+
+	std::vector<char> buffer;
+	std::string directory, file_name, message;
+	size_t line_number = 0;
+};
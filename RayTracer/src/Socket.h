@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+// Minimal blocking TCP socket, enough for the tile protocol: listen/accept on one side, connect on
+// the other, and exact-length sends and receives. Move-only; closes itself.
+class Socket
+{
+public:
+#if defined(_WIN32)
+	using Handle = SOCKET;
+	static constexpr Handle invalid = INVALID_SOCKET;
+#else
+	using Handle = int;
+	static constexpr Handle invalid = -1;
+#endif
+
+	Socket() = default;
+	explicit Socket(Handle h) : handle(h) {}
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+	Socket(Socket&& o) noexcept : handle(o.handle) { o.handle = invalid; }
+	Socket& operator=(Socket&& o) noexcept
+	{
+		if (this != &o) {
+			close();
+			handle = o.handle;
+			o.handle = invalid;
+		}
+		return *this;
+	}
+	~Socket() { close(); }
+
+	// must be called once before any socket is created
+	static bool startup()
+	{
+#if defined(_WIN32)
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+		return true;
+#endif
+	}
+
+	bool valid() const { return handle != invalid; }
+
+	bool listen(uint16_t port)
+	{
+		close();
+		handle = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (handle == invalid)
+			return false;
+		int yes = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+		if (::bind(handle, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(handle, 16) != 0) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	// true once accept() or receiveAll() would not block (data or a closed peer), false after timeout_ms
+	bool readable(int timeout_ms) const
+	{
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(handle, &set);
+		timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+		return ::select((int)handle + 1, &set, nullptr, nullptr, &timeout) > 0;
+	}
+
+	Socket accept() const
+	{
+		Socket client(::accept(handle, nullptr, nullptr));
+		client.noDelay();
+		return client;
+	}
+
+	bool connect(const char* host, uint16_t port)
+	{
+		close();
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* addresses = nullptr;
+		if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &addresses) != 0)
+			return false;
+		for (addrinfo* a = addresses; a; a = a->ai_next) {
+			handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+			if (handle == invalid)
+				continue;
+			if (::connect(handle, a->ai_addr, (int)a->ai_addrlen) == 0)
+				break;
+			close();
+		}
+		freeaddrinfo(addresses);
+		noDelay();
+		return valid();
+	}
+
+	// receiveAll() fails once a single wait for data exceeds `seconds`; 0 waits forever
+	bool receiveTimeout(double seconds)
+	{
+#if defined(_WIN32)
+		DWORD timeout = (DWORD)(seconds * 1000.0);
+#else
+		timeval timeout = { (time_t)seconds, (suseconds_t)((seconds - (time_t)seconds) * 1e6) };
+#endif
+		return setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == 0;
+	}
+
+	bool sendAll(const void* data, size_t size)
+	{
+		const char* p = (const char*)data;
+		while (size > 0) {
+			int chunk = (int)std::min<size_t>(size, 1 << 30);
+			int sent = (int)::send(handle, p, chunk, send_flags);
+			if (sent <= 0)
+				return false;
+			p += sent;
+			size -= sent;
+		}
+		return true;
+	}
+
+	bool receiveAll(void* data, size_t size)
+	{
+		char* p = (char*)data;
+		while (size > 0) {
+			int chunk = (int)std::min<size_t>(size, 1 << 30);
+			int received = (int)::recv(handle, p, chunk, 0);
+			if (received <= 0)
+				return false;
+			p += received;
+			size -= received;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (handle == invalid)
+			return;
+#if defined(_WIN32)
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+		handle = invalid;
+	}
+
+private:
+#if defined(MSG_NOSIGNAL)
+	static constexpr int send_flags = MSG_NOSIGNAL; // a closed peer is an error to handle, not SIGPIPE
+#else
+	static constexpr int send_flags = 0;
+#endif
+
+	// messages are small and answered right away, do not let Nagle hold them back
+	void noDelay()
+	{
+		if (handle == invalid)
+			return;
+		int yes = 1;
+		setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+	}
+
+	Handle handle = invalid;
+};
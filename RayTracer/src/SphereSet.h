@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPHERESET_SSE
+#endif
+
+#include "Ray.h"
+#include "BVH.h"
+#include "Buffer.h"
+#include "PrimitiveSet.h"
+
+// Spheres stored as a structure of arrays: the intersection loop only streams the geometry
+// it needs, and shading data is looked up afterwards through the material index.
+struct SphereSet : PrimitiveSet<SphereSet>
+{
+	Buffer<float> cx, cy, cz, radius;
+	Buffer<uint32_t> material;
+
+	size_t size() const { return radius.size(); }
+	bool empty() const { return radius.empty(); }
+
+	void reserve(size_t n)
+	{
+		cx.reserve(n); cy.reserve(n); cz.reserve(n); radius.reserve(n);
+		material.reserve(n);
+	}
+
+	void add(const vec3& c, float r, uint32_t m)
+	{
+		cx.push_back(c.x); cy.push_back(c.y); cz.push_back(c.z); radius.push_back(r);
+		material.push_back(m);
+	}
+
+	vec3 center(uint32_t i) const { return vec3(cx[i], cy[i], cz[i]); }
+	uint32_t materialId(uint32_t i) const { return material[i]; }
+
+	AABB bounds(uint32_t i) const
+	{
+		float r = radius[i] * 1.0001f; // a little slack so grazing hits never fall through the box test
+		return AABB(center(i) - vec3(r), center(i) + vec3(r));
+	}
+
+	// reorders the spheres so that slot i holds what was in slot order[i]
+	void permute(const std::vector<uint32_t>& order)
+	{
+		reorder(cx, order); reorder(cy, order); reorder(cz, order); reorder(radius, order);
+		reorder(material, order);
+	}
+
+	template<typename S, typename F>
+	static void forEachArray(S& set, F&& visit)
+	{
+		visit(set.cx); visit(set.cy); visit(set.cz); visit(set.radius);
+		visit(set.material);
+	}
+
+	bool hit(uint32_t i, const Ray& ray, float& t0) const
+	{
+		vec3 L = center(i) - ray.orig;
+
+		float a = dot(ray.dir, ray.dir);
+		float b = -2.0f * dot(ray.dir, L);
+		float c = dot(L, L) - radius[i] * radius[i];
+
+		float discriminant = b * b - 4 * a * c;
+		if (discriminant < 0)
+			return false;
+
+		t0 = (-b - std::sqrt(discriminant)) / (2.0f * a);
+		float t1 = (-b + std::sqrt(discriminant)) / (2.0f * a);
+		if (t0 < 0) t0 = t1;
+		if (t0 < 0) return false;
+		return true;
+	}
+
+	void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3&) const
+	{
+		point = ray.at(t);
+		N = (point - center(i)).normalized();
+	}
+
+	// Closest hit among slots [first, first + count). Shrinks tmax and sets nearest when a sphere
+	// closer than tmax is found; ties go to the lower slot, as in a plain loop.
+	void intersect(const Ray& ray, uint32_t first, uint32_t count, float& tmax, uint32_t& nearest) const
+	{
+		uint32_t i = first, end = first + count;
+#if defined(__AVX__) || defined(SPHERESET_SSE)
+		for (; i + lanes <= end; i += lanes) {
+			float t[lanes];
+			hitLanes(ray, i, t);
+			for (uint32_t k = 0; k < lanes; ++k) {
+				if (t[k] < tmax) {
+					tmax = t[k];
+					nearest = i + k;
+				}
+			}
+		}
+#endif
+		for (; i < end; ++i) {
+			float t;
+			if (hit(i, ray, t) && t < tmax) {
+				tmax = t;
+				nearest = i;
+			}
+		}
+	}
+
+	// any hit closer than tmax among slots [first, first + count)
+	bool occluded(const Ray& ray, uint32_t first, uint32_t count, float tmax) const
+	{
+		uint32_t i = first, end = first + count;
+#if defined(__AVX__) || defined(SPHERESET_SSE)
+		for (; i + lanes <= end; i += lanes) {
+			float t[lanes];
+			hitLanes(ray, i, t);
+			for (uint32_t k = 0; k < lanes; ++k)
+				if (t[k] < tmax)
+					return true;
+		}
+#endif
+		for (; i < end; ++i) {
+			float t;
+			if (hit(i, ray, t) && t < tmax)
+				return true;
+		}
+		return false;
+	}
+
+	// Packet versions: each sphere in the range is tested against all lanes at once, and only
+	// lanes in `mask` take the result. Same arithmetic as hit(), written branch-free per lane.
+	void intersectPacket(const RayPacket& packet, uint32_t first, uint32_t count, uint32_t mask, float* tmax, uint32_t* nearest) const
+	{
+		for (uint32_t i = first; i < first + count; ++i) {
+			float t[RayPacket::size];
+			hitPacket(i, packet, t);
+			for (int k = 0; k < RayPacket::size; ++k) {
+				if ((mask >> k & 1) && t[k] < tmax[k]) {
+					tmax[k] = t[k];
+					nearest[k] = i;
+				}
+			}
+		}
+	}
+
+	// returns the lanes in `mask` that hit something closer than their tmax
+	uint32_t occludedPacket(const RayPacket& packet, uint32_t first, uint32_t count, uint32_t mask, const float* tmax) const
+	{
+		uint32_t occluded = 0;
+		for (uint32_t i = first; i < first + count && occluded != mask; ++i) {
+			float t[RayPacket::size];
+			hitPacket(i, packet, t);
+			for (int k = 0; k < RayPacket::size; ++k)
+				occluded |= (uint32_t)(t[k] < tmax[k]) << k;
+			occluded &= mask;
+		}
+		return occluded;
+	}
+
+private:
+	void hitPacket(uint32_t i, const RayPacket& packet, float* t_out) const
+	{
+		for (int k = 0; k < RayPacket::size; ++k) {
+			float Lx = cx[i] - packet.ox[k], Ly = cy[i] - packet.oy[k], Lz = cz[i] - packet.oz[k];
+
+			float a = packet.dx[k] * packet.dx[k] + packet.dy[k] * packet.dy[k] + packet.dz[k] * packet.dz[k];
+			float b = -2.0f * (packet.dx[k] * Lx + packet.dy[k] * Ly + packet.dz[k] * Lz);
+			float c = (Lx * Lx + Ly * Ly + Lz * Lz) - radius[i] * radius[i];
+
+			float discriminant = b * b - 4 * a * c;
+			float sq = std::sqrt(std::max(discriminant, 0.0f));
+			float t0 = (-b - sq) / (2.0f * a);
+			float t1 = (-b + sq) / (2.0f * a);
+			if (t0 < 0) t0 = t1;
+			t_out[k] = (discriminant >= 0 && t0 >= 0) ? t0 : std::numeric_limits<float>::infinity();
+		}
+	}
+
+	// Vector version of hit() for `lanes` consecutive slots. Operations are done in the same
+	// order as the scalar code so both paths produce the same distances; misses come out as +inf.
+#if defined(__AVX__)
+	static constexpr uint32_t lanes = 8;
+
+	void hitLanes(const Ray& ray, uint32_t i, float* t_out) const
+	{
+		const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+		const __m256 zero = _mm256_setzero_ps();
+		float a_s = dot(ray.dir, ray.dir);
+		__m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+
+		__m256 Lx = _mm256_sub_ps(_mm256_loadu_ps(&cx[i]), _mm256_set1_ps(ray.orig.x));
+		__m256 Ly = _mm256_sub_ps(_mm256_loadu_ps(&cy[i]), _mm256_set1_ps(ray.orig.y));
+		__m256 Lz = _mm256_sub_ps(_mm256_loadu_ps(&cz[i]), _mm256_set1_ps(ray.orig.z));
+		__m256 r = _mm256_loadu_ps(&radius[i]);
+
+		__m256 dL = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, Lx), _mm256_mul_ps(dy, Ly)), _mm256_mul_ps(dz, Lz));
+		__m256 LL = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lx, Lx), _mm256_mul_ps(Ly, Ly)), _mm256_mul_ps(Lz, Lz));
+		__m256 b = _mm256_mul_ps(_mm256_set1_ps(-2.0f), dL);
+		__m256 c = _mm256_sub_ps(LL, _mm256_mul_ps(r, r));
+		__m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(_mm256_set1_ps(4 * a_s), c));
+		__m256 valid = _mm256_cmp_ps(disc, zero, _CMP_GE_OQ);
+
+		__m256 sq = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+		__m256 two_a = _mm256_set1_ps(2.0f * a_s);
+		__m256 nb = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+		__m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, sq), two_a);
+		__m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, sq), two_a);
+		t0 = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t0, zero, _CMP_GE_OQ));
+		_mm256_storeu_ps(t_out, _mm256_blendv_ps(inf, t0, valid));
+	}
+#elif defined(SPHERESET_SSE)
+	static constexpr uint32_t lanes = 4;
+
+	void hitLanes(const Ray& ray, uint32_t i, float* t_out) const
+	{
+		const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		const __m128 zero = _mm_setzero_ps();
+		float a_s = dot(ray.dir, ray.dir);
+		__m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+
+		__m128 Lx = _mm_sub_ps(_mm_loadu_ps(&cx[i]), _mm_set1_ps(ray.orig.x));
+		__m128 Ly = _mm_sub_ps(_mm_loadu_ps(&cy[i]), _mm_set1_ps(ray.orig.y));
+		__m128 Lz = _mm_sub_ps(_mm_loadu_ps(&cz[i]), _mm_set1_ps(ray.orig.z));
+		__m128 r = _mm_loadu_ps(&radius[i]);
+
+		__m128 dL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, Lx), _mm_mul_ps(dy, Ly)), _mm_mul_ps(dz, Lz));
+		__m128 LL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Lx, Lx), _mm_mul_ps(Ly, Ly)), _mm_mul_ps(Lz, Lz));
+		__m128 b = _mm_mul_ps(_mm_set1_ps(-2.0f), dL);
+		__m128 c = _mm_sub_ps(LL, _mm_mul_ps(r, r));
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_set1_ps(4 * a_s), c));
+		__m128 valid = _mm_cmpge_ps(disc, zero);
+
+		__m128 sq = _mm_sqrt_ps(_mm_max_ps(disc, zero));
+		__m128 two_a = _mm_set1_ps(2.0f * a_s);
+		__m128 nb = _mm_xor_ps(b, _mm_set1_ps(-0.0f));
+		__m128 t0 = _mm_div_ps(_mm_sub_ps(nb, sq), two_a);
+		__m128 t1 = _mm_div_ps(_mm_add_ps(nb, sq), two_a);
+		__m128 use_t1 = _mm_cmplt_ps(t0, zero);
+		t0 = _mm_or_ps(_mm_and_ps(use_t1, t1), _mm_andnot_ps(use_t1, t0));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(t0, zero));
+		_mm_storeu_ps(t_out, _mm_or_ps(_mm_and_ps(valid, t0), _mm_andnot_ps(valid, inf)));
+	}
+#endif
+};
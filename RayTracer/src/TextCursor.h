@@ -0,0 +1,60 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string_view>
+
+#include "Vector.h"
+
+// Whitespace separated tokens of one line. Both parsers leave the cursor after the token.
+struct TextCursor
+{
+	const char* p;
+	const char* end;
+
+	void skip()
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			++p;
+	}
+
+	bool word(std::string_view& w)
+	{
+		skip();
+		const char* start = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			++p;
+		w = std::string_view(start, p - start);
+		return !w.empty();
+	}
+
+	bool number(float& x)
+	{
+		skip();
+		if (p < end && *p == '+')
+			++p;
+		std::from_chars_result r = std::from_chars(p, end, x);
+		if (r.ec != std::errc() || (r.ptr < end && *r.ptr != ' ' && *r.ptr != '\t' && *r.ptr != '\r'))
+			return false;
+		p = r.ptr;
+		return true;
+	}
+
+	bool integer(uint32_t& x)
+	{
+		skip();
+		std::from_chars_result r = std::from_chars(p, end, x);
+		if (r.ec != std::errc() || (r.ptr < end && *r.ptr != ' ' && *r.ptr != '\t' && *r.ptr != '\r'))
+			return false;
+		p = r.ptr;
+		return true;
+	}
+
+	bool vector(vec3& v) { return number(v.x) && number(v.y) && number(v.z); }
+
+	bool done()
+	{
+		skip();
+		return p == end || *p == '#';
+	}
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile
+{
+	int x0, y0, x1, y1; // pixel range [x0, x1) x [y0, y1)
+
+	int width() const { return x1 - x0; }
+	int height() const { return y1 - y0; }
+};
+
+// Splits the image into tiles and hands them out to a pool of worker threads.
+// Each worker owns a deque seeded with a contiguous run of tiles (scanline order keeps
+// neighbouring tiles, and their rays, on the same core); once it runs dry it steals
+// from the back of the fullest other queue.
+class TileScheduler
+{
+public:
+	TileScheduler(int width, int height, int tile_size, unsigned thread_count = 0)
+		: TileScheduler(Tile{ 0, 0, width, height }, tile_size, thread_count) {}
+
+	// tiles only the pixels of `region`, in image coordinates
+	TileScheduler(const Tile& region, int tile_size, unsigned thread_count = 0)
+	{
+		tile_size = std::max(1, tile_size);
+		for (int y = region.y0; y < region.y1; y += tile_size)
+			for (int x = region.x0; x < region.x1; x += tile_size)
+				tiles.push_back({ x, y, std::min(x + tile_size, region.x1), std::min(y + tile_size, region.y1) });
+
+		if (thread_count == 0)
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		thread_count = std::max(1u, std::min(thread_count, (unsigned)tiles.size()));
+
+		queues = std::vector<WorkQueue>(thread_count);
+		for (uint32_t t = 0; t < tiles.size(); ++t)
+			queues[(uint64_t)t * thread_count / tiles.size()].tiles.push_back(t);
+	}
+
+	unsigned threadCount() const { return (unsigned)queues.size(); }
+	size_t tileCount() const { return tiles.size(); }
+
+	// Calls render_tile(const Tile&, unsigned worker) once for every tile and returns when all are done.
+	template<typename F>
+	void run(F&& render_tile)
+	{
+		auto worker = [&](unsigned id) {
+			uint32_t t;
+			while (pop(id, t) || steal(id, t))
+				render_tile(tiles[t], id);
+		};
+
+		std::vector<std::thread> threads;
+		for (unsigned id = 1; id < threadCount(); ++id)
+			threads.emplace_back(worker, id);
+		worker(0);
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+private:
+	struct alignas(64) WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<uint32_t> tiles;
+	};
+
+	bool pop(unsigned id, uint32_t& t)
+	{
+		std::lock_guard<std::mutex> lock(queues[id].mutex);
+		if (queues[id].tiles.empty())
+			return false;
+		t = queues[id].tiles.front();
+		queues[id].tiles.pop_front();
+		return true;
+	}
+
+	bool steal(unsigned id, uint32_t& t)
+	{
+		for (;;) {
+			// pick the victim with the most remaining work; it may drain before we lock it again, so retry
+			unsigned victim = id;
+			size_t most = 0;
+			for (unsigned i = 0; i < queues.size(); ++i) {
+				if (i == id) continue;
+				std::lock_guard<std::mutex> lock(queues[i].mutex);
+				if (queues[i].tiles.size() > most) {
+					most = queues[i].tiles.size();
+					victim = i;
+				}
+			}
+			if (victim == id)
+				return false;
+
+			std::lock_guard<std::mutex> lock(queues[victim].mutex);
+			if (queues[victim].tiles.empty())
+				continue;
+			t = queues[victim].tiles.back();
+			queues[victim].tiles.pop_back();
+			return true;
+		}
+	}
+
+	std::vector<Tile> tiles;
+	std::vector<WorkQueue> queues;
+};
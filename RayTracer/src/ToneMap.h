@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TONEMAP_SSE
+#endif
+
+#include "TileScheduler.h"
+#include "Vector.h"
+
+// How linear radiance becomes 8-bit pixels: exposure, then an operator that brings it into [0, 1],
+// then the transfer curve of the output.
+//   max       divides by the largest channel when it is above 1, keeping the hue (the original mapping)
+//   reinhard  x / (1 + x) per channel
+//   aces      Narkowicz's fit of the ACES filmic curve
+enum class ToneOperator { Max, Reinhard, Aces };
+enum class TransferCurve { Linear, Gamma, Srgb };
+
+struct ToneMapSettings
+{
+	ToneOperator op = ToneOperator::Max;
+	float exposure = 1.0f;
+	TransferCurve transfer = TransferCurve::Linear;
+	float gamma = 2.2f;
+	unsigned threads = 0; // 0: one per hardware thread
+};
+
+// Four pixels at a time in SSE lanes: the interleaved RGB floats are transposed into one register
+// per channel, mapped, transposed back and packed to bytes. The scalar path does the same
+// operations in the same order, so a pixel maps to the same byte whichever path it takes.
+// Gamma and sRGB go through a table indexed by the value in 16-bit fixed point.
+class ToneMapper
+{
+public:
+	ToneMapper(const ToneMapSettings& settings = ToneMapSettings()) : settings(settings)
+	{
+		if (settings.transfer == TransferCurve::Linear)
+			return;
+		curve.resize(curve_size);
+		for (uint32_t i = 0; i < curve_size; ++i) {
+			float x = (float)i / (curve_size - 1), y;
+			if (settings.transfer == TransferCurve::Srgb)
+				y = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+			else
+				y = std::pow(x, 1.0f / settings.gamma);
+			curve[i] = (unsigned char)(255 * std::max(0.0f, std::min(1.0f, y)));
+		}
+	}
+
+	const ToneMapSettings& config() const { return settings; }
+
+	// maps n pixels; out receives 3n bytes
+	void map(const vec3* in, size_t n, unsigned char* out) const
+	{
+		size_t i = 0;
+#if defined(TONEMAP_SSE)
+		for (; i + 4 <= n; i += 4)
+			mapLanes(&in[i].x, out + i * 3);
+#endif
+		for (; i < n; ++i)
+			mapPixel(in[i], out + i * 3);
+	}
+
+	// the whole framebuffer, spread over the worker threads in chunks of pixels
+	void operator()(const std::vector<vec3>& framebuffer, std::vector<unsigned char>& pixmap) const
+	{
+		static_assert(sizeof(vec3) == 3 * sizeof(float), "pixels are read as packed float RGB");
+		pixmap.resize(framebuffer.size() * 3);
+		const size_t chunk = 16384;
+		int chunks = (int)((framebuffer.size() + chunk - 1) / chunk);
+		if (chunks <= 1) {
+			map(framebuffer.data(), framebuffer.size(), pixmap.data());
+			return;
+		}
+		TileScheduler scheduler(Tile{ 0, 0, 1, chunks }, 1, settings.threads);
+		scheduler.run([&](const Tile& tile, unsigned) {
+			size_t first = (size_t)tile.y0 * chunk;
+			map(&framebuffer[first], std::min(chunk, framebuffer.size() - first), &pixmap[first * 3]);
+		});
+	}
+
+private:
+	static constexpr uint32_t curve_size = 65536;
+
+	float applyOperator(float x, float inv_max) const
+	{
+		switch (settings.op) {
+		case ToneOperator::Max: return x * inv_max;
+		case ToneOperator::Reinhard: x = std::max(x, 0.0f); return x / (1.0f + x);
+		default: x = std::max(x, 0.0f); return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+		}
+	}
+
+	unsigned char quantize(float x) const
+	{
+		x = std::max(0.0f, std::min(1.0f, x)); // NaN ends up as 1, like _mm_min_ps
+		if (curve.empty())
+			return (unsigned char)(int)(x * 255.0f);
+		return curve[(int)(x * (float)(curve_size - 1) + 0.5f)];
+	}
+
+	void mapPixel(const vec3& pixel, unsigned char* out) const
+	{
+		float c[3] = { pixel.x * settings.exposure, pixel.y * settings.exposure, pixel.z * settings.exposure };
+		float inv_max = 1.0f;
+		if (settings.op == ToneOperator::Max) {
+			float max = std::max(std::max(c[1], c[2]), c[0]);
+			if (max > 1.0f) inv_max = 1.0f / max;
+		}
+		for (int k = 0; k < 3; ++k)
+			out[k] = quantize(applyOperator(c[k], inv_max));
+	}
+
+#if defined(TONEMAP_SSE)
+	__m128 applyOperator(__m128 x, __m128 inv_max) const
+	{
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+		switch (settings.op) {
+		case ToneOperator::Max:
+			return _mm_mul_ps(x, inv_max);
+		case ToneOperator::Reinhard:
+			x = _mm_max_ps(x, zero);
+			return _mm_div_ps(x, _mm_add_ps(one, x));
+		default: {
+			x = _mm_max_ps(x, zero);
+			__m128 num = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), x), _mm_set1_ps(0.03f)));
+			__m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), x), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+			return _mm_div_ps(num, den);
+		}
+		}
+	}
+
+	void mapLanes(const float* p, unsigned char* out) const
+	{
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), exposure = _mm_set1_ps(settings.exposure);
+		// r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3 -> one register per channel
+		__m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);
+		__m128 r = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 1, 0, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+		__m128 g = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 bl = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+		r = _mm_mul_ps(r, exposure);
+		g = _mm_mul_ps(g, exposure);
+		bl = _mm_mul_ps(bl, exposure);
+
+		__m128 inv_max = one;
+		if (settings.op == ToneOperator::Max) {
+			__m128 max = _mm_max_ps(_mm_max_ps(g, bl), r);
+			__m128 above = _mm_cmpgt_ps(max, one);
+			inv_max = _mm_or_ps(_mm_and_ps(above, _mm_div_ps(one, max)), _mm_andnot_ps(above, one));
+		}
+		r = _mm_max_ps(_mm_min_ps(applyOperator(r, inv_max), one), zero);
+		g = _mm_max_ps(_mm_min_ps(applyOperator(g, inv_max), one), zero);
+		bl = _mm_max_ps(_mm_min_ps(applyOperator(bl, inv_max), one), zero);
+
+		// and back to r0 g0 b0 r1 | g1 b1 r2 g2 | b2 r3 g3 b3
+		a = _mm_shuffle_ps(_mm_shuffle_ps(r, g, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shuffle_ps(bl, r, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+		b = _mm_shuffle_ps(_mm_shuffle_ps(g, bl, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(r, g, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+		c = _mm_shuffle_ps(_mm_shuffle_ps(bl, r, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(g, bl, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+
+		if (!curve.empty()) {
+			const __m128 scale = _mm_set1_ps((float)(curve_size - 1)), half = _mm_set1_ps(0.5f);
+			alignas(16) int32_t index[12];
+			_mm_store_si128((__m128i*)index, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, scale), half)));
+			_mm_store_si128((__m128i*)(index + 4), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(b, scale), half)));
+			_mm_store_si128((__m128i*)(index + 8), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(c, scale), half)));
+			for (int k = 0; k < 12; ++k)
+				out[k] = curve[index[k]];
+			return;
+		}
+		const __m128 scale = _mm_set1_ps(255.0f);
+		__m128i words = _mm_packs_epi32(_mm_cvttps_epi32(_mm_mul_ps(a, scale)), _mm_cvttps_epi32(_mm_mul_ps(b, scale)));
+		__m128i last = _mm_cvttps_epi32(_mm_mul_ps(c, scale));
+		__m128i bytes = _mm_packus_epi16(words, _mm_packs_epi32(last, last));
+		_mm_storel_epi64((__m128i*)out, bytes);
+		int32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+		memcpy(out + 8, &tail, 4);
+	}
+#endif
+
+	ToneMapSettings settings;
+	std::vector<unsigned char> curve; // transfer curve, empty when linear
+};
+
+// the original mapping by default
+inline void tonemap(const std::vector<vec3>& framebuffer, std::vector<unsigned char>& pixmap, const ToneMapper& mapper = ToneMapper())
+{
+	mapper(framebuffer, pixmap);
+}
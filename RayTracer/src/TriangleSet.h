@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRIANGLESET_SSE
+#endif
+
+#include "Ray.h"
+#include "BVH.h"
+#include "Buffer.h"
+#include "PrimitiveSet.h"
+
+// Triangles stored as a structure of arrays of their corner positions, so the intersection loop
+// streams only those; the shading normals are looked up afterwards through three normal indices
+// per triangle. Meshes are flattened into one set, every triangle with its own material.
+struct TriangleSet : PrimitiveSet<TriangleSet>
+{
+	Buffer<float> ax, ay, az, bx, by, bz, cx, cy, cz;
+	Buffer<uint32_t> corner_normals; // three per triangle, indices into normals
+	Buffer<vec3> normals;
+	Buffer<uint32_t> material;
+
+	// The ray in the space of the watertight test: kz is the axis the ray runs along most, and the
+	// shear (sx, sy) maps its direction onto +z (Woop, Benthin and Wald, 2013).
+	struct Shear
+	{
+		int kx, ky, kz;
+		float sx, sy, sz;
+	};
+
+	size_t size() const { return material.size(); }
+	bool empty() const { return material.empty(); }
+
+	void reserve(size_t n)
+	{
+		ax.reserve(n); ay.reserve(n); az.reserve(n);
+		bx.reserve(n); by.reserve(n); bz.reserve(n);
+		cx.reserve(n); cy.reserve(n); cz.reserve(n);
+		corner_normals.reserve(3 * n);
+		material.reserve(n);
+	}
+
+	void add(const vec3& a, const vec3& b, const vec3& c, uint32_t na, uint32_t nb, uint32_t nc, uint32_t m)
+	{
+		ax.push_back(a.x); ay.push_back(a.y); az.push_back(a.z);
+		bx.push_back(b.x); by.push_back(b.y); bz.push_back(b.z);
+		cx.push_back(c.x); cy.push_back(c.y); cz.push_back(c.z);
+		corner_normals.push_back(na); corner_normals.push_back(nb); corner_normals.push_back(nc);
+		material.push_back(m);
+	}
+
+	vec3 a(uint32_t i) const { return vec3(ax[i], ay[i], az[i]); }
+	vec3 b(uint32_t i) const { return vec3(bx[i], by[i], bz[i]); }
+	vec3 c(uint32_t i) const { return vec3(cx[i], cy[i], cz[i]); }
+	uint32_t materialId(uint32_t i) const { return material[i]; }
+
+	AABB bounds(uint32_t i) const
+	{
+		AABB box;
+		box.grow(a(i));
+		box.grow(b(i));
+		box.grow(c(i));
+		// a little slack so the box test never rejects a ray the edge test would accept
+		vec3 extent = box.max - box.min;
+		vec3 pad(1e-4f * std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-2f)));
+		return AABB(box.min - pad, box.max + pad);
+	}
+
+	// reorders the triangles so that slot i holds what was in slot order[i]
+	void permute(const std::vector<uint32_t>& order)
+	{
+		reorder(ax, order); reorder(ay, order); reorder(az, order);
+		reorder(bx, order); reorder(by, order); reorder(bz, order);
+		reorder(cx, order); reorder(cy, order); reorder(cz, order);
+		reorder(material, order);
+		Buffer<uint32_t> tmp;
+		tmp.resize(corner_normals.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			for (int k = 0; k < 3; ++k)
+				tmp[3 * i + k] = corner_normals[3 * order[i] + k];
+		corner_normals.swap(tmp);
+	}
+
+	template<typename S, typename F>
+	static void forEachArray(S& set, F&& visit)
+	{
+		visit(set.ax); visit(set.ay); visit(set.az);
+		visit(set.bx); visit(set.by); visit(set.bz);
+		visit(set.cx); visit(set.cy); visit(set.cz);
+		visit(set.corner_normals); visit(set.normals); visit(set.material);
+	}
+
+	static Shear shear(const Ray& ray)
+	{
+		Shear s;
+		float ax_ = std::fabs(ray.dir.x), ay_ = std::fabs(ray.dir.y), az_ = std::fabs(ray.dir.z);
+		s.kz = ax_ > ay_ ? (ax_ > az_ ? 0 : 2) : (ay_ > az_ ? 1 : 2);
+		s.kx = s.kz == 2 ? 0 : s.kz + 1;
+		s.ky = s.kx == 2 ? 0 : s.kx + 1;
+		if (ray.dir[s.kz] < 0.0f)
+			std::swap(s.kx, s.ky); // keep the winding
+		s.sx = ray.dir[s.kx] / ray.dir[s.kz];
+		s.sy = ray.dir[s.ky] / ray.dir[s.kz];
+		s.sz = 1.0f / ray.dir[s.kz];
+		return s;
+	}
+
+	// Watertight ray/triangle test. In the sheared space the ray is the +z axis, and the signs of the
+	// three edge functions U, V, W (of the edges opposite a, b and c) say which side of each edge
+	// it passes. An edge shared by two triangles gets the same value in both, so a ray can never
+	// slip through between them; when one comes out exactly zero it is recomputed in double.
+	// barycentric, if given, receives the weights of a, b and c.
+	bool hit(uint32_t i, const Ray& ray, const Shear& s, float& t, vec3* barycentric = nullptr) const
+	{
+		vec3 A = a(i) - ray.orig, B = b(i) - ray.orig, C = c(i) - ray.orig;
+		float Ax = A[s.kx] - s.sx * A[s.kz], Ay = A[s.ky] - s.sy * A[s.kz];
+		float Bx = B[s.kx] - s.sx * B[s.kz], By = B[s.ky] - s.sy * B[s.kz];
+		float Cx = C[s.kx] - s.sx * C[s.kz], Cy = C[s.ky] - s.sy * C[s.kz];
+
+		float U = Cx * By - Cy * Bx;
+		float V = Ax * Cy - Ay * Cx;
+		float W = Bx * Ay - By * Ax;
+		if (U == 0.0f || V == 0.0f || W == 0.0f) {
+			U = (float)((double)Cx * By - (double)Cy * Bx);
+			V = (float)((double)Ax * Cy - (double)Ay * Cx);
+			W = (float)((double)Bx * Ay - (double)By * Ax);
+		}
+		if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+			return false;
+		float det = U + V + W;
+		if (det == 0.0f)
+			return false;
+
+		float T = U * (s.sz * A[s.kz]) + V * (s.sz * B[s.kz]) + W * (s.sz * C[s.kz]);
+		t = T / det;
+		if (!(t > 0.0f))
+			return false;
+		if (barycentric)
+			*barycentric = vec3(U / det, V / det, W / det);
+		return true;
+	}
+
+	// Closest hit among slots [first, first + count). Shrinks tmax and sets nearest when a triangle
+	// closer than tmax is found; ties go to the lower slot, as in a plain loop.
+	void intersect(const Ray& ray, uint32_t first, uint32_t count, float& tmax, uint32_t& nearest) const
+	{
+		Shear s = shear(ray);
+		uint32_t i = first, end = first + count;
+#if defined(TRIANGLESET_SSE)
+		for (; i + lanes <= end; i += lanes) {
+			float t[lanes];
+			hitLanes(ray, s, i, t);
+			for (uint32_t k = 0; k < lanes; ++k) {
+				if (t[k] < tmax) {
+					tmax = t[k];
+					nearest = i + k;
+				}
+			}
+		}
+#endif
+		for (; i < end; ++i) {
+			float t;
+			if (hit(i, ray, s, t) && t < tmax) {
+				tmax = t;
+				nearest = i;
+			}
+		}
+	}
+
+	// any hit closer than tmax among slots [first, first + count)
+	bool occluded(const Ray& ray, uint32_t first, uint32_t count, float tmax) const
+	{
+		Shear s = shear(ray);
+		uint32_t i = first, end = first + count;
+#if defined(TRIANGLESET_SSE)
+		for (; i + lanes <= end; i += lanes) {
+			float t[lanes];
+			hitLanes(ray, s, i, t);
+			for (uint32_t k = 0; k < lanes; ++k)
+				if (t[k] < tmax)
+					return true;
+		}
+#endif
+		for (; i < end; ++i) {
+			float t;
+			if (hit(i, ray, s, t) && t < tmax)
+				return true;
+		}
+		return false;
+	}
+
+	bool hit(uint32_t i, const Ray& ray, float& t) const { return hit(i, ray, shear(ray), t); }
+
+	// the hit point and the normal interpolated from the corners
+	void surface(uint32_t i, const Ray& ray, float t, vec3& point, vec3& N, vec3&) const
+	{
+		float t_hit;
+		vec3 w(1.0f / 3.0f);
+		hit(i, ray, shear(ray), t_hit, &w);
+		const uint32_t* n = &corner_normals[3 * (size_t)i];
+		point = ray.at(t);
+		N = (normals[n[0]] * w.x + normals[n[1]] * w.y + normals[n[2]] * w.z).normalized();
+	}
+
+private:
+#if defined(TRIANGLESET_SSE)
+	static constexpr uint32_t lanes = 4;
+
+	// Vector version of hit() for `lanes` consecutive slots, with the operations in the same order so
+	// both paths give the same distances; misses come out as +inf. Lanes that need the double
+	// precision edge functions are redone by hit().
+	void hitLanes(const Ray& ray, const Shear& s, uint32_t i, float* t_out) const
+	{
+		const Buffer<float>* A[3] = { &ax, &ay, &az };
+		const Buffer<float>* B[3] = { &bx, &by, &bz };
+		const Buffer<float>* C[3] = { &cx, &cy, &cz };
+		const __m128 zero = _mm_setzero_ps(), inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		__m128 ox = _mm_set1_ps(ray.orig[s.kx]), oy = _mm_set1_ps(ray.orig[s.ky]), oz = _mm_set1_ps(ray.orig[s.kz]);
+		__m128 sx = _mm_set1_ps(s.sx), sy = _mm_set1_ps(s.sy), sz = _mm_set1_ps(s.sz);
+
+		__m128 Az = _mm_sub_ps(_mm_loadu_ps(&(*A[s.kz])[i]), oz);
+		__m128 Bz = _mm_sub_ps(_mm_loadu_ps(&(*B[s.kz])[i]), oz);
+		__m128 Cz = _mm_sub_ps(_mm_loadu_ps(&(*C[s.kz])[i]), oz);
+		__m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*A[s.kx])[i]), ox), _mm_mul_ps(sx, Az));
+		__m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*A[s.ky])[i]), oy), _mm_mul_ps(sy, Az));
+		__m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*B[s.kx])[i]), ox), _mm_mul_ps(sx, Bz));
+		__m128 By = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*B[s.ky])[i]), oy), _mm_mul_ps(sy, Bz));
+		__m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*C[s.kx])[i]), ox), _mm_mul_ps(sx, Cz));
+		__m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&(*C[s.ky])[i]), oy), _mm_mul_ps(sy, Cz));
+
+		__m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+		__m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+		__m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+		__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+		__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+		__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+		__m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(sz, Az)), _mm_mul_ps(V, _mm_mul_ps(sz, Bz))), _mm_mul_ps(W, _mm_mul_ps(sz, Cz)));
+		__m128 t = _mm_div_ps(T, det);
+		__m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpgt_ps(t, zero)));
+		_mm_storeu_ps(t_out, _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, inf)));
+
+		int exact = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero)));
+		for (uint32_t k = 0; exact; ++k, exact >>= 1)
+			if (exact & 1 && !hit(i + k, ray, s, t_out[k]))
+				t_out[k] = std::numeric_limits<float>::infinity();
+	}
+#endif
+};
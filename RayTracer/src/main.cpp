@@ -1,245 +1,303 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <iostream>
-#include <fstream>
+#include <cstring>
+#include <string>
 #include <vector>
-#include <cmath>
 
-#include "Vector.h"
+#include "Animation.h"
+#include "Camera.h"
+#include "Distributed.h"
+#include "ImageOutput.h"
+#include "Preview.h"
+#include "Renderer.h"
+#include "Scene.h"
+#include "SceneCache.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-#define PI 3.14159265358979323846
+static std::atomic<bool> interrupted(false);
 
-int envmap_width, envmap_height;
-std::vector<vec3> envmap;
-
-struct Light
-{
-	Light(const vec3& p, float i) : position(p), intensity(i) {}
-	vec3 position;
-	float intensity;
-};
-
-struct Material
-{
-	Material(float r, const vec4& a, const vec3& color, float spec) : refractive_index(r), albedo(a), diffuse_color(color), specular_exponent(spec) {}
-	Material() : refractive_index(1.0f), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
-	float refractive_index;
-	vec4 albedo;
-	vec3 diffuse_color;
-	float specular_exponent;
-};
-
-struct Ray
+static void on_interrupt(int)
 {
-	vec3 orig;
-	vec3 dir;
-
-	Ray() : orig(0.0f), dir(0.0f) {}
-	Ray(const vec3& o, const vec3& d) : orig(o), dir(d) {}
-
-	vec3 at(float t) const { return orig + t * dir; }
-};
-
-struct Sphere
-{
-	vec3 center;
-	float radius;
-	Material material;
-
-	Sphere() : center(0.0f), radius(0.0f), material() {}
-	Sphere(const vec3& c, float r, const Material& m) : center(c), radius(r), material(m) {}
-
-	bool hit(const Ray& ray, float& t0) const {
-		vec3 L = center - ray.orig;
-
-		float a = dot(ray.dir, ray.dir);
-		float b = -2.0f * dot(ray.dir, L);
-		float c = dot(L, L) - radius * radius;
-
-		float discriminant = b * b - 4 * a * c;
-		if (discriminant < 0)
-			return false;
-
-		t0 = (-b - std::sqrt(discriminant)) / (2.0f * a);
-		float t1 = (-b + std::sqrt(discriminant)) / (2.0f * a);
-		if (t0 < 0) t0 = t1;
-		if (t0 < 0) return false;
-		return true;
-	}
-};
-
-// ر˵reflect䷽ɵָԴģrefract䷽ɹԴָ
-vec3 reflect(const vec3& L, const vec3& N)
-{
-	return 2 * dot(L, N) * N - L;
+	interrupted = true;
 }
 
-vec3 refract(const vec3& L, const vec3& N, float refractive_index)
+int main(int argc, char** argv)
 {
-	float cosi = -std::max(-1.0f, std::min(1.0f, dot(L, N)));
-	float etai = 1, etat = refractive_index;
-	vec3 n = N;
-	if (cosi < 0) {
-		cosi = -cosi;
-		std::swap(etai, etat);
-		n = -N;
-	}
-	float eta = etai / etat;
-	float k = 1 - eta * eta * (1 - cosi * cosi);
-	return k < 0 ? vec3(0.0f) : eta * L + (eta * cosi - sqrtf(k)) * n;
-}
-
-bool scene_intersect(const Ray& ray, const std::vector<Sphere>& spheres, vec3& hitPoint, vec3& N, Material& material)
-{
-	float sphere_dist = std::numeric_limits<float>::max();
-	for (auto& sphere : spheres) {
-		float dist_i;
-		if (sphere.hit(ray, dist_i) && dist_i < sphere_dist) {
-			sphere_dist = dist_i;
-			hitPoint = ray.at(dist_i);
-			N = (hitPoint - sphere.center).normalized();
-			material = sphere.material;
+	RenderSettings settings;
+	ProgressiveSettings progressive;
+	bool progressive_mode = false;
+	EnvironmentMap::Filter env_filter = EnvironmentMap::Filter::Nearest;
+	const char* scene_path = nullptr;
+	const char* animation_path = nullptr;
+	bool serve = false;
+	bool relight_cache = false;
+	int preview_scale = 4;
+	std::string environment_cache;
+	const char* output_path = "out.jpg";
+	const char* format_name = nullptr;
+	ToneMapSettings tone;
+	int width = 1280, height = 720;
+	int strip = 0, strip_count = 1;
+	int coordinator_port = 0, distributed_tile_size = 128;
+	double distributed_timeout = 300.0;
+	std::string worker_host;
+	int worker_port = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--scene") && i + 1 < argc)
+			scene_path = argv[++i];
+		else if (!strcmp(argv[i], "--animation") && i + 1 < argc)
+			animation_path = argv[++i];
+		else if (!strcmp(argv[i], "--serve"))
+			serve = true;
+		else if (!strcmp(argv[i], "--relight-cache"))
+			relight_cache = true;
+		else if (!strcmp(argv[i], "--preview-scale") && i + 1 < argc)
+			preview_scale = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+			output_path = argv[++i];
+		else if (!strcmp(argv[i], "--format") && i + 1 < argc)
+			format_name = argv[++i];
+		else if (!strcmp(argv[i], "--tonemap") && i + 1 < argc && (!strcmp(argv[i + 1], "max") || !strcmp(argv[i + 1], "reinhard") || !strcmp(argv[i + 1], "aces"))) {
+			const char* name = argv[++i];
+			tone.op = !strcmp(name, "reinhard") ? ToneOperator::Reinhard : (!strcmp(name, "aces") ? ToneOperator::Aces : ToneOperator::Max);
 		}
-	}
-
-	float checkerboard_dist = std::numeric_limits<float>::max();
-	if (fabs(ray.dir.y) > 1e-3) {
-		float d = -(ray.orig.y + 4) / ray.dir.y; // the checkerboard plane has equation y = -4
-		vec3 pt = ray.orig + ray.dir * d;
-		if (d > 0 && fabs(pt.x) < 10 && pt.z < -10 && pt.z > -30 && d < sphere_dist) {
-			checkerboard_dist = d;
-			hitPoint = pt;
-			N = vec3(0.0f, 1.0f, 0.0f);
-			material.diffuse_color = (int(0.5f * hitPoint.x + 1000) + int(0.5f * hitPoint.z)) & 1 ? vec3(1.0f) : vec3(1.0f, 0.7f, 0.3f); // Ϊͼ
-			material.diffuse_color = material.diffuse_color * 0.3f;
+		else if (!strcmp(argv[i], "--exposure") && i + 1 < argc)
+			tone.exposure = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--gamma") && i + 1 < argc) {
+			const char* curve = argv[++i];
+			tone.transfer = !strcmp(curve, "srgb") ? TransferCurve::Srgb : TransferCurve::Gamma;
+			if (tone.transfer == TransferCurve::Gamma)
+				tone.gamma = std::stof(curve);
 		}
-	}
-	return std::min(sphere_dist, checkerboard_dist) < 1000.0f;
-}
-
-vec3 castRay(const Ray& ray, const std::vector<Sphere>& spheres, const std::vector<Light>& lights, size_t depth = 0)
-{
-	vec3 point, N;
-	Material material;
-	// background color
-	if (depth > 4 || !scene_intersect(ray, spheres, point, N, material)) {
-		// background color
-		float phi = atan2(ray.dir.z, ray.dir.x); // [-, ]
-		float theta = acos(ray.dir.y); // [0, ]
-		// ensure x and y in range
-		int x = std::max(0, std::min(envmap_width - 1, int((phi + PI) / (2 * PI) * envmap_width)));
-		int y = std::max(0, std::min(envmap_height - 1, int(theta / PI * envmap_height)));
-		return envmap[x + y * envmap_width];
-	}
-	/*
-	- atan2ֵ [-, ]
-		- 壺atan2 ص  X ʱת (x, z) ĽǶȣֵΪʱ뷽0  УֵΪ˳ʱ뷽-0  -У
-		- һԣ x < 0 ʱָ X Ḻ򣩣atan2 ԶǶƫ Уȷʼ [-, ] ڡ
-		- 磺
-		- ߷ X ᣨx=1, z=0  = 0
-		- ߷ X ᣨx=-1, z=0  = 
-		- ߷ Z ᣨx=0, z=1  = /2
-		- ߷ Z ᣨx=0, z=-1  = -/2
-	- acosֵ [0, ]
-		- acos(1) = 0
-		- acos(-1) = 
-	 */
-
-	vec3 reflect_dir = reflect(-ray.dir, N).normalized();
-	vec3 reflect_orig = dot(reflect_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f; // ޸һС
-	vec3 reflect_color = castRay(Ray(reflect_orig, reflect_dir), spheres, lights, depth + 1);
-	
-	vec3 refract_dir = refract(ray.dir, N, material.refractive_index).normalized();
-	vec3 refract_orig = dot(refract_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f;
-	vec3 refract_color = castRay(Ray(refract_orig, refract_dir), spheres, lights, depth + 1);
-
-	float diffuse_light_intensity = 0, specular_light_intensity = 0;
-	for (uint32_t i = 0; i < lights.size(); ++i) {
-		vec3 light_dir = (lights[i].position - point).normalized();
-		float light_distance = (lights[i].position - point).norm();
-
-		vec3 shadow_orig = dot(light_dir, N) < 0 ? point - N * 0.001f : point + N * 0.001f; // ֹӰཻ
-		vec3 shadow_pt, shadow_N;
-		Material tmp;
-		if (scene_intersect(Ray(shadow_orig, light_dir), spheres, shadow_pt, shadow_N, tmp) && (shadow_pt - shadow_orig).norm() < light_distance)
-			continue;
-
-		diffuse_light_intensity += lights[i].intensity * std::max(0.0f, dot(light_dir, N));
-		specular_light_intensity += lights[i].intensity * powf(std::max(0.0f, dot(reflect(light_dir, N), -ray.dir)), material.specular_exponent);
-	}
-	// sphere color
-	return diffuse_light_intensity * material.diffuse_color * material.albedo[0]
-		+ specular_light_intensity * vec3(1.0f) * material.albedo[1]
-		+ reflect_color * material.albedo[2]
-		+ refract_color * material.albedo[3];
-}
-
-void render(const std::vector<Sphere>& spheres, const std::vector<Light>& lights)
-{
-	const int width = 1280;
-	const int height = 720;
-	float fov = (float)PI / 2; // 45 degree
-	float aspect = (float)width / height;
-
-	std::vector<vec3> framebuffer(width * height);
-
-	for (uint32_t j = 0; j < height; ++j) {
-		for (uint32_t i = 0; i < width; ++i) {
-			float x = (2 * (i + 0.5f) / (float)width - 1.0f) * tan(fov / 2.0f) * aspect;
-			float y = -(2 * (j + 0.5f) / (float)height - 1.0f) * tan(fov / 2.0f);
-			vec3 dir = vec3(x, y, -1).normalized();
-			framebuffer[i + j * width] = castRay(Ray(vec3(0.0f), dir), spheres, lights);
+		else if (!strcmp(argv[i], "--width") && i + 1 < argc)
+			width = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--height") && i + 1 < argc)
+			height = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--crop") && i + 4 < argc) {
+			settings.crop.x0 = std::stoi(argv[++i]);
+			settings.crop.y0 = std::stoi(argv[++i]);
+			settings.crop.x1 = std::stoi(argv[++i]);
+			settings.crop.y1 = std::stoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--strip") && i + 2 < argc) {
+			strip = std::stoi(argv[++i]);
+			strip_count = std::stoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--progressive") && i + 1 < argc) {
+			progressive.passes = std::stoi(argv[++i]);
+			progressive_mode = true;
 		}
+		else if (!strcmp(argv[i], "--flush-interval") && i + 1 < argc)
+			progressive.flush_interval = std::stod(argv[++i]);
+		else if (!strcmp(argv[i], "--time-limit") && i + 1 < argc) {
+			progressive.time_limit = std::stod(argv[++i]);
+			progressive_mode = true;
+		}
+		else if (!strcmp(argv[i], "--coordinator") && i + 1 < argc)
+			coordinator_port = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--dist-tile-size") && i + 1 < argc)
+			distributed_tile_size = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--dist-timeout") && i + 1 < argc)
+			distributed_timeout = std::stod(argv[++i]);
+		else if (!strcmp(argv[i], "--worker") && i + 1 < argc && strrchr(argv[i + 1], ':')) {
+			const char* address = argv[++i];
+			const char* colon = strrchr(address, ':');
+			worker_host.assign(address, colon);
+			worker_port = std::stoi(colon + 1);
+		}
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			settings.threads = (unsigned)std::stoul(argv[++i]);
+		else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc)
+			settings.tile_size = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--no-packets"))
+			settings.packets = false;
+		else if (!strcmp(argv[i], "--min-weight") && i + 1 < argc)
+			settings.min_weight = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--roulette") && i + 1 < argc)
+			settings.roulette_weight = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--samples") && i + 1 < argc)
+			settings.samples = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i], "--aa-threshold") && i + 1 < argc)
+			settings.adaptive_threshold = std::stof(argv[++i]);
+		else if (!strcmp(argv[i], "--env-cache") && i + 1 < argc)
+			environment_cache = argv[++i];
+		else if (!strcmp(argv[i], "--env-filter") && i + 1 < argc && (!strcmp(argv[i + 1], "nearest") || !strcmp(argv[i + 1], "bilinear")))
+			env_filter = !strcmp(argv[++i], "bilinear") ? EnvironmentMap::Filter::Bilinear : EnvironmentMap::Filter::Nearest;
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--scene FILE] [--animation FILE] [--relight-cache] [--serve] [--preview-scale N] [--output FILE] [--format jpg|png|hdr|pfm|raw] [--tonemap max|reinhard|aces] [--exposure E] [--gamma G|srgb] [--width N] [--height N] [--crop X0 Y0 X1 Y1] [--strip K N] [--progressive PASSES] [--flush-interval S] [--time-limit S] [--coordinator PORT] [--dist-tile-size N] [--dist-timeout S] [--worker HOST:PORT] [--threads N] [--tile-size N] [--no-packets] [--min-weight W] [--roulette W] [--samples N] [--aa-threshold T] [--env-filter nearest|bilinear] [--env-cache DIR]" << std::endl;
+			return -1;
+		}
+	}
+	if (tone.transfer == TransferCurve::Gamma && !(tone.gamma > 0.0f)) {
+		std::cerr << "Error: the gamma must be positive!" << std::endl;
+		return -1;
+	}
+	if (!valid_sample_count(settings.samples)) {
+		std::cerr << "Error: the sample count must be a perfect square (1, 4, 9, 16, ...)!" << std::endl;
+		return -1;
+	}
+	if (width <= 0 || height <= 0 || strip_count <= 0 || strip < 0 || strip >= strip_count) {
+		std::cerr << "Error: the resolution must be positive and the strip index within [0, N)!" << std::endl;
+		return -1;
+	}
+	ImageFormat format = image_format_for(output_path);
+	if (format_name && !parse_image_format(format_name, format)) {
+		std::cerr << "Error: unknown output format " << format_name << "!" << std::endl;
+		return -1;
+	}
+	if ((coordinator_port != 0 || worker_port != 0) && progressive_mode) {
+		std::cerr << "Error: distributed rendering does not support the progressive mode!" << std::endl;
+		return -1;
+	}
+	if (!(distributed_timeout >= 0.0)) {
+		std::cerr << "Error: the distributed timeout can not be negative!" << std::endl;
+		return -1;
 	}
 
-	std::vector<unsigned char> pixmap(width * height * 3);
+	if ((animation_path || serve) && (coordinator_port != 0 || worker_port != 0 || progressive_mode)) {
+		std::cerr << "Error: animations and the preview server render locally and not progressively!" << std::endl;
+		return -1;
+	}
+	if (serve && (animation_path || preview_scale <= 0)) {
+		std::cerr << "Error: the preview server takes no animation and a positive preview scale!" << std::endl;
+		return -1;
+	}
 
-	for (uint32_t i = 0; i < width * height; ++i) {
-		vec3& c = framebuffer[i];
-		float max = std::max(c[0], std::max(c[1], c[2]));
-		if (max > 1) c = c * (1.0f / max);
-		for (uint32_t j = 0; j < 3; ++j) {
-			pixmap[i * 3 + j] = (unsigned char)(255 * std::max(0.0f, std::min(1.0f, framebuffer[i][j])));
+	std::string error;
+	Animation animation;
+	if (animation_path && !animation.load(animation_path)) {
+		std::cerr << "Error: " << animation.error() << std::endl;
+		return -1;
+	}
+	if (worker_port != 0) {
+		// everything else comes from the coordinator, only the local thread count and tile size apply
+		if (!render_worker(worker_host.c_str(), (uint16_t)worker_port, settings, scene_path ? scene_path : "", environment_cache, error)) {
+			std::cerr << "Error: " << error << std::endl;
+			return -1;
 		}
+		return 0;
 	}
-	stbi_write_jpg("out.jpg", width, height, 3, pixmap.data(), 100);
-}
 
-int main()
-{
-	int channel = -1;
-	unsigned char* pixmap = stbi_load("./envmap.jpg", &envmap_width, &envmap_height, &channel, 0);
-	if (!pixmap || channel != 3) {
-		std::cerr << "Error: can not load the environment map!" << std::endl;
+	// the coordinator only hands out tiles, the workers load the scene themselves
+	Scene scene;
+	std::vector<uint32_t> sphere_order;
+	if (coordinator_port == 0 && !prepare_scene(scene_path ? scene_path : "", scene, error, environment_cache, &sphere_order)) {
+		std::cerr << "Error: " << error << std::endl;
 		return -1;
 	}
-	envmap.reserve(envmap_width * envmap_height);
-	for (int j = envmap_height - 1; j >= 0; --j) {
-		for (int i = 0; i < envmap_width; ++i) {
-			envmap[i + j * envmap_width] = vec3(pixmap[(i + j * envmap_width) * 3 + 0], pixmap[(i + j * envmap_width) * 3 + 1], pixmap[(i + j * envmap_width) * 3 + 2]) * (1.0f / 255.0f);
+	if (animation_path && !animation.bind(scene, sphere_order)) {
+		std::cerr << "Error: " << animation.error() << std::endl;
+		return -1;
+	}
+	scene.environment.setFilter(env_filter);
+	const View& view = scene.view;
+	Camera camera(view.position, view.look_at, view.up, view.fov, width, height);
+
+	// strip K of N is a band of whole rows of the crop window, or of the image without one
+	Tile region = render_region(camera, settings);
+	int rows = region.height(), top = region.y0;
+	region.y0 = top + (int)((int64_t)rows * strip / strip_count);
+	region.y1 = top + (int)((int64_t)rows * (strip + 1) / strip_count);
+	if (region.width() <= 0 || region.height() <= 0) {
+		std::cerr << "Error: nothing to render, the crop window or strip is empty!" << std::endl;
+		return -1;
+	}
+	settings.crop = region;
+
+	tone.threads = settings.threads;
+	const ToneMapper mapper(tone);
+	auto save = [&](const std::vector<vec3>& framebuffer) {
+		if (!write_image(output_path, format, region.width(), region.height(), framebuffer, mapper))
+			std::cerr << "Error: can not write " << output_path << "!" << std::endl;
+	};
+
+	std::vector<vec3> framebuffer;
+	RenderStats stats;
+	if (serve) {
+		// edits come in on stdin; previews are rendered at a fraction of the resolution and kept up to
+		// date tile by tile, "render" does a full one at the command line settings
+		Preview preview(scene, settings, std::max(1, width / preview_scale), std::max(1, height / preview_scale), sphere_order);
+		serve_preview(preview, stdin, output_path, format, mapper, [&](const std::string& path, std::string& error) {
+			Camera full(view.position, view.look_at, view.up, view.fov, width, height);
+			std::vector<vec3> image;
+			render(scene, full, settings, image);
+			if (!write_image(path.c_str(), image_format_for(path), region.width(), region.height(), image, mapper)) {
+				error = "can not write " + path;
+				return false;
+			}
+			return true;
+		});
+		stats = preview.totals();
+	}
+	else if (progressive_mode) {
+		// Ctrl-C stops after the tiles in flight and still writes the image accumulated so far
+		progressive.abort = &interrupted;
+		std::signal(SIGINT, on_interrupt);
+		stats = render_progressive(scene, camera, settings, progressive, framebuffer, save);
+	}
+	else if (coordinator_port != 0) {
+		DistributedJob job;
+		job.width = width;
+		job.height = height;
+		job.samples = settings.samples;
+		job.adaptive_threshold = settings.adaptive_threshold;
+		job.min_weight = settings.min_weight;
+		job.roulette_weight = settings.roulette_weight;
+		job.packets = settings.packets ? 1 : 0;
+		job.bilinear_environment = env_filter == EnvironmentMap::Filter::Bilinear ? 1 : 0;
+		if (!render_coordinator((uint16_t)coordinator_port, job, scene_path ? scene_path : "", region, distributed_tile_size, distributed_timeout, framebuffer, stats, error)) {
+			std::cerr << "Error: " << error << std::endl;
+			return -1;
 		}
 	}
-	stbi_image_free(pixmap);
-
-	Material ivory(1.0f, vec4(0.6f, 0.3f, 0.1f, 0.0f), vec3(0.4f, 0.4f, 0.3f), 50.0f);
-	Material red(1.0f, vec4(0.9f, 0.1f, 0.0f, 0.0f), vec3(0.3f, 0.1f, 0.1f), 10.0f);
-	Material mirror(1.0f, vec4(0.0f, 10.0f, 0.8f, 0.0f), vec3(1.0f), 1425.0f);
-	Material glass(1.5f, vec4(0.0f, 0.5f, 0.1f, 0.8f), vec3(0.6f, 0.7f, 0.8f), 125.0f);
-
-	std::vector<Sphere> spheres;
-	spheres.emplace_back(vec3(-3, 0, -16), 2, ivory);
-	spheres.emplace_back(vec3(-1.0, -1.5, -12), 2, glass);
-	spheres.emplace_back(vec3(1.5, -0.5, -18), 3, red);
-	spheres.emplace_back(vec3(7, 5, -18), 4, mirror);
-
-	std::vector<Light> lights;
-	lights.emplace_back(vec3(-20, 20, 20), 1.5f);
-	lights.emplace_back(vec3(30, 50, -25), 1.8f);
-	lights.emplace_back(vec3(30, 20, 30), 1.7f);
-
-	render(spheres, lights);
+	else if (animation_path) {
+		// The scene, its environment map and the material tables stay loaded across frames; moving
+		// spheres only refit the BVH, and with the relight cache frames where only lights change
+		// trace just their shadow rays. Frame k is encoded on a thread of its own while k + 1 renders.
+		ToneMapSettings background = tone;
+		background.threads = 1;
+		BackgroundWriter writer(format, region.width(), region.height(), ToneMapper(background));
+		GeometryCache geometry;
+		for (int frame = 0; frame < animation.frames; ++frame) {
+			auto start = std::chrono::steady_clock::now();
+			unsigned change = animation.apply(frame, scene);
+			if (change & SpheresMoved)
+				scene.refitAccelerationStructure();
+			if (!geometry.empty() && !(change & (SpheresMoved | ViewChanged))) {
+				stats += relight(scene, settings, geometry, framebuffer);
+			}
+			else {
+				Camera frame_camera(view.position, view.look_at, view.up, view.fov, width, height);
+				stats += render(scene, frame_camera, settings, framebuffer, nullptr, relight_cache ? &geometry : nullptr);
+			}
+			writer.write(frame_path(output_path, frame), framebuffer);
+			std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+			std::cout << "frame " << frame + 1 << " / " << animation.frames << ": " << seconds.count() << " s" << std::endl;
+		}
+		for (const std::string& path : writer.finish())
+			std::cerr << "Error: can not write " << path << "!" << std::endl;
+	}
+	else if (format == ImageFormat::Jpeg) {
+		// strips are tone mapped and encoded as soon as their rows are done, while the rest renders
+		JpegStream jpeg(region.width(), region.height(), framebuffer, mapper);
+		stats = render(scene, camera, settings, framebuffer, [&](int y0, int y1) { jpeg.rowsDone(y0 - region.y0, y1 - region.y0); });
+		if (!write_file(output_path, [&](ImageSink* sink, void* context) { return jpeg.finish(sink, context); }))
+			std::cerr << "Error: can not write " << output_path << "!" << std::endl;
+	}
+	else {
+		stats = render(scene, camera, settings, framebuffer);
+	}
+	if (progressive_mode || settings.samples > 1)
+		std::cout << (double)stats.primary_rays / ((double)region.width() * region.height() * animation.frames) << " samples per pixel" << std::endl;
+	if (!animation_path && !serve && (progressive_mode || coordinator_port != 0 || format != ImageFormat::Jpeg))
+		save(framebuffer);
+	std::cout << "rays: " << stats.primary_rays << " primary, " << stats.secondary_rays << " secondary, " << stats.shadow_rays << " shadow; "
+		<< stats.culled_rays << " culled by weight, " << stats.terminated_rays << " terminated by roulette" << std::endl;
 	return 0;
 }
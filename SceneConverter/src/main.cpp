@@ -0,0 +1,49 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Scene.h"
+#include "SceneCache.h"
+#include "SceneLoader.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+// Converts a text scene file into a binary scene cache with a prebuilt BVH, which RayTracer and
+// Benchmark map directly when given it with --scene.
+int main(int argc, char** argv)
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <input.scene> <output.rtscene>" << std::endl;
+		return -1;
+	}
+
+	using Clock = std::chrono::steady_clock;
+	Clock::time_point start = Clock::now();
+	Scene scene;
+	SceneLoader loader(scene);
+	if (!loader.load(argv[1])) {
+		std::cerr << "Error: " << loader.error() << std::endl;
+		return -1;
+	}
+	Clock::time_point loaded = Clock::now();
+	std::vector<uint32_t> sphere_order = scene.buildAccelerationStructure();
+	Clock::time_point built = Clock::now();
+
+	std::string error;
+	if (!save_scene_cache(scene, sphere_order, argv[2], error)) {
+		std::cerr << "Error: " << error << std::endl;
+		return -1;
+	}
+	Clock::time_point saved = Clock::now();
+
+	auto ms = [](Clock::time_point a, Clock::time_point b) { return std::chrono::duration<double, std::milli>(b - a).count(); };
+	size_t nodes = 0;
+	scene.forEachPrimitiveType([&](PrimitiveType, const auto&, const BVH* bvh) { nodes += bvh ? bvh->nodes.size() : 0; });
+	printf("%zu spheres, %zu triangles, %zu disks, %zu boxes, %zu planes, %zu lights, %zu BVH nodes\n", scene.spheres.size(), scene.triangles.size(),
+		scene.disks.size(), scene.boxes.size(), scene.planes.size(), scene.lights.size(), nodes);
+	printf("parsed in %.0f ms, BVH built in %.0f ms, written in %.0f ms\n", ms(start, loaded), ms(loaded, built), ms(built, saved));
+	return 0;
+}